@@ -11,6 +11,9 @@ static const char *fonts[]         = {
 	"DejaVuSansM Nerd Font:pixelsize=12:antialias=true:autohint=true"
 	"DejaVu Sans Mono Nerd Font:pixelsize=12:antialias=true:autohint=true",
 };
+static const int persistfontmisses = 1; /* remember glyphs missing from all fonts across restarts */
+static const int clientrender       = 0; /* rasterize the bar in dwm and upload it, via MIT-SHM if possible */
+static const unsigned int renderthreads = 3; /* threads rasterizing bars besides the main one, see clientrender */
 static const char col_gray1[]      = "#222222";
 static const char col_gray2[]      = "#444444";
 static const char col_gray3[]      = "#bbbbbb";
@@ -37,6 +40,10 @@ static const Rule rules[] = {
 	/* xprop(1):
 	 *  WM_CLASS(STRING) -> instance, class
 	 *  WM_NAME(STRING)  -> title
+	 * Patterns match substrings; a leading '^' or a trailing '$' anchors
+	 * them to the beginning or end. Patterns enclosed in slashes, e.g.
+	 * "/^(Gimp|Inkscape)$/", are POSIX extended regular expressions. NULL
+	 * matches anything.
 	 */
 	/* class            , instance , title                          , tags mask , isfloating , isprotected , monitor */
 	{ "Gimp"            , NULL     , NULL                           , 0         , 1          , 0           , -1 } ,
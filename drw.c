@@ -1,14 +1,24 @@
 /* See LICENSE file for copyright and license details. */
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
 #include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
 #include <X11/Xft/Xft.h>
 
 #include "drw.h"
 #include "util.h"
 
 #define UTF_SIZ     4
+#define LENGTH(X)   (sizeof X / sizeof X[0])
+#define COVMISS     UCHAR_MAX /* no font covers the codepoint, see fontfor() */
 
 static const unsigned char utfbyte[UTF_SIZ + 1] = {0x80,    0, 0xC0, 0xE0, 0xF0};
 static const unsigned char utfmask[UTF_SIZ + 1] = {0xC0, 0x80, 0xE0, 0xF0, 0xF8};
@@ -66,6 +76,493 @@ utf8decode(const char *c, long *u, size_t clen)
 	return len;
 }
 
+/*
+ * Client-side rasterizer, see drw_clientside(). Drawing into a drawable
+ * records operations in the display list of a canvas kept for the drawable.
+ * drw_flush() executes the display lists of all canvases in parallel on a
+ * pool of threads, each into an image in our memory, and uploads the results
+ * through a shared memory segment if the MIT-SHM extension is available.
+ * Glyphs are rendered once by FreeType on the main thread and kept in an 8-bit
+ * coverage atlas which is only read while executing display lists.
+ */
+#define ATLASW      1024
+#define ATLASH      1024
+#define ATLASN      4096 /* capacity of the glyph table, power of 2 */
+
+typedef struct {
+	XftFont *font; /* NULL if the slot is free */
+	FT_UInt glyph;
+	unsigned short x, y, w, h; /* position in the atlas */
+	short left, top; /* offset of the bitmap from the pen position */
+} AtlasGlyph;
+
+/* Glyph of a display list, its bitmap being at ('ax', 'ay') in the atlas */
+typedef struct {
+	int x, y;
+	unsigned short ax, ay, w, h;
+} RasterGlyph;
+
+/* Operation of a display list: blends glyphs [glyph, glyph + nglyphs) in
+ * color 'pixel' if nglyphs is nonzero and fills the rectangle otherwise. */
+typedef struct {
+	int x, y, w, h;
+	unsigned long pixel;
+	size_t glyph, nglyphs;
+} RasterOp;
+
+typedef struct {
+	Window win;
+	int x, y;
+	unsigned int w, h;
+} RasterMap;
+
+typedef struct {
+	Drawable drawable; /* None if the canvas is unused */
+	XImage *img; /* mirrors the drawable */
+	XShmSegmentInfo shm;
+	int isshm;
+	unsigned long putseq; /* request number of the last XShmPutImage() */
+	int x0, y0, x1, y1; /* region drawn but not uploaded yet */
+	RasterOp *ops;
+	size_t nops, capops;
+	RasterGlyph *glyphs;
+	size_t nglyphs, capglyphs;
+	RasterMap *maps; /* copies to windows deferred until drw_flush() */
+	size_t nmaps, capmaps;
+} Canvas;
+
+struct Raster {
+	int useshm;
+	int shmopcode; /* major opcode of MIT-SHM */
+	Canvas **canvases, *cur; /* canvases don't move, see XShmCreateImage() */
+	size_t ncanvases;
+	unsigned char *atlas;
+	int ax, ay, ah; /* packing cursor, height of the current shelf */
+	AtlasGlyph *glyphs;
+	size_t nglyphs;
+	/* Worker pool, see raster_worker(). Canvases queue[next] onwards have
+	 * yet to be executed, 'pending' of them have not been finished. */
+	pthread_t *threads;
+	size_t nthreads;
+	pthread_mutex_t lock;
+	pthread_cond_t work, done;
+	Canvas **queue;
+	size_t nqueue, next, pending;
+	int quit;
+};
+
+static int shmfailed, shmopcode;
+static XErrorHandler shmprevhandler;
+
+/* Note failing MIT-SHM requests, leave any other error to the previous handler. */
+static int
+raster_shmerror(Display *dpy, XErrorEvent *ee)
+{
+	if (ee->request_code != shmopcode)
+		return shmprevhandler(dpy, ee);
+	shmfailed = 1;
+	return 0;
+}
+
+static void
+canvas_freeimg(Drw *drw, XImage *img, XShmSegmentInfo *shm)
+{
+	if (!img)
+		return;
+	if (shm) {
+		XShmDetach(drw->dpy, shm);
+		shmdt(shm->shmaddr);
+		img->data = NULL;
+	}
+	XDestroyImage(img);
+}
+
+static void
+canvas_free(Drw *drw, Canvas *cv)
+{
+	canvas_freeimg(drw, cv->img, cv->isshm ? &cv->shm : NULL);
+	free(cv->ops);
+	free(cv->glyphs);
+	free(cv->maps);
+	memset(cv, 0, sizeof(Canvas));
+}
+
+/* Make sure the image of 'cv' covers 'w' x 'h' pixels, keeping its contents
+ * as the image mirrors the drawable. */
+static void
+canvas_resize(Drw *drw, Canvas *cv, unsigned int w, unsigned int h)
+{
+	Raster *r = drw->raster;
+	XImage *old = cv->img;
+	XShmSegmentInfo oldshm = cv->shm;
+	int y, oldisshm = cv->isshm;
+
+	if (old && (unsigned int)old->width >= w && (unsigned int)old->height >= h)
+		return;
+	if (old) {
+		w = MAX(w, (unsigned int)old->width);
+		h = MAX(h, (unsigned int)old->height);
+	}
+	cv->img = NULL;
+	cv->isshm = 0;
+	if (r->useshm) {
+		cv->img = XShmCreateImage(drw->dpy, drw->visual, drw->depth, ZPixmap,
+			NULL, &cv->shm, w, h);
+		if (cv->img && (cv->shm.shmid = shmget(IPC_PRIVATE,
+		    cv->img->bytes_per_line * h, IPC_CREAT | 0600)) != -1) {
+			cv->shm.shmaddr = cv->img->data = shmat(cv->shm.shmid, NULL, 0);
+			cv->shm.readOnly = False;
+			/* Attaching fails e.g. for remote displays. This is only
+			 * ever reported asynchronously. Errors of requests queued
+			 * before are handled as usual. */
+			XSync(drw->dpy, False);
+			shmfailed = 0;
+			shmopcode = r->shmopcode;
+			shmprevhandler = XSetErrorHandler(raster_shmerror);
+			XShmAttach(drw->dpy, &cv->shm);
+			XSync(drw->dpy, False);
+			XSetErrorHandler(shmprevhandler);
+			shmctl(cv->shm.shmid, IPC_RMID, NULL);
+			if (cv->shm.shmaddr != (char *)-1 && !shmfailed) {
+				memset(cv->img->data, 0, cv->img->bytes_per_line * h);
+				cv->isshm = 1;
+			} else if (cv->shm.shmaddr != (char *)-1) {
+				shmdt(cv->shm.shmaddr);
+			}
+		}
+		if (cv->img && !cv->isshm) {
+			cv->img->data = NULL;
+			XDestroyImage(cv->img);
+			cv->img = NULL;
+		}
+		r->useshm = cv->isshm;
+	}
+	if (!cv->img) {
+		cv->img = XCreateImage(drw->dpy, drw->visual, drw->depth, ZPixmap, 0,
+			NULL, w, h, 32, 0);
+		cv->img->data = ecalloc(h, cv->img->bytes_per_line);
+	}
+	if (!old)
+		return;
+	/* The server may still be reading the old image. */
+	if (cv->putseq && (long)(LastKnownRequestProcessed(drw->dpy) - cv->putseq) < 0)
+		XSync(drw->dpy, False);
+	cv->putseq = 0;
+	for (y = 0; y < old->height; y++)
+		memcpy(cv->img->data + y * cv->img->bytes_per_line,
+			old->data + y * old->bytes_per_line, old->width * 4);
+	canvas_freeimg(drw, old, oldisshm ? &oldshm : NULL);
+}
+
+/* Return the canvas of 'drawable', creating it if necessary. */
+static Canvas *
+canvas_get(Drw *drw, Drawable drawable)
+{
+	Raster *r = drw->raster;
+	Canvas *cv = NULL;
+	size_t i;
+
+	for (i = 0; i < r->ncanvases; i++) {
+		if (r->canvases[i]->drawable == drawable)
+			return r->canvases[i];
+		if (!cv && !r->canvases[i]->drawable)
+			cv = r->canvases[i];
+	}
+	if (!cv) {
+		if (!(r->canvases = realloc(r->canvases, ++r->ncanvases * sizeof(Canvas *)))
+		|| !(r->queue = realloc(r->queue, r->ncanvases * sizeof(Canvas *))))
+			die("realloc:");
+		cv = r->canvases[r->ncanvases - 1] = ecalloc(1, sizeof(Canvas));
+	}
+	cv->drawable = drawable;
+	return cv;
+}
+
+static void
+canvas_damage(Canvas *cv, int x, int y, int w, int h)
+{
+	if (cv->x0 >= cv->x1) {
+		cv->x0 = x;
+		cv->y0 = y;
+		cv->x1 = x + w;
+		cv->y1 = y + h;
+	} else {
+		cv->x0 = MIN(cv->x0, x);
+		cv->y0 = MIN(cv->y0, y);
+		cv->x1 = MAX(cv->x1, x + w);
+		cv->y1 = MAX(cv->y1, y + h);
+	}
+}
+
+static RasterOp *
+canvas_op(Canvas *cv)
+{
+	if (cv->nops == cv->capops) {
+		cv->capops = cv->capops ? 2 * cv->capops : 64;
+		if (!(cv->ops = realloc(cv->ops, cv->capops * sizeof(RasterOp))))
+			die("realloc:");
+	}
+	return &cv->ops[cv->nops++];
+}
+
+/* Execute the display list of 'cv'. Runs on the worker threads, so it must
+ * neither talk to the X server nor modify the atlas. */
+static void
+canvas_exec(const Raster *r, Canvas *cv)
+{
+	const RasterOp *op;
+	const RasterGlyph *g;
+	unsigned char *d, *s, a;
+	uint32_t *row;
+	size_t i;
+	int x, y, x0, x1, y0, y1, c;
+
+	for (op = cv->ops; op < cv->ops + cv->nops; op++) {
+		s = (unsigned char *)&op->pixel;
+		if (!op->nglyphs) {
+			x0 = MAX(op->x, 0);
+			y0 = MAX(op->y, 0);
+			x1 = MIN(op->x + op->w, cv->img->width);
+			y1 = MIN(op->y + op->h, cv->img->height);
+			for (y = y0; y < y1; y++)
+				for (row = (uint32_t *)(cv->img->data + y * cv->img->bytes_per_line), x = x0; x < x1; x++)
+					row[x] = op->pixel;
+			continue;
+		}
+		for (i = op->glyph; i < op->glyph + op->nglyphs; i++) {
+			g = &cv->glyphs[i];
+			for (y = MAX(0, -g->y); y < g->h && g->y + y < cv->img->height; y++) {
+				row = (uint32_t *)(cv->img->data + (g->y + y) * cv->img->bytes_per_line);
+				for (x = MAX(0, -g->x); x < g->w && g->x + x < cv->img->width; x++) {
+					if (!(a = r->atlas[(g->ay + y) * ATLASW + g->ax + x]))
+						continue;
+					if (a == 0xff) {
+						row[g->x + x] = op->pixel;
+						continue;
+					}
+					d = (unsigned char *)&row[g->x + x];
+					for (c = 0; c < 4; c++)
+						d[c] = (s[c] * a + d[c] * (0xff - a) + 0x7f) / 0xff;
+				}
+			}
+		}
+	}
+}
+
+/* Execute queued display lists until none is left. Called with the lock
+ * held. */
+static void
+raster_drain(Raster *r)
+{
+	Canvas *cv;
+
+	while (r->next < r->nqueue) {
+		cv = r->queue[r->next++];
+		pthread_mutex_unlock(&r->lock);
+		canvas_exec(r, cv);
+		pthread_mutex_lock(&r->lock);
+		if (!--r->pending)
+			pthread_cond_signal(&r->done);
+	}
+}
+
+static void *
+raster_worker(void *arg)
+{
+	Raster *r = arg;
+
+	pthread_mutex_lock(&r->lock);
+	while (!r->quit) {
+		raster_drain(r);
+		pthread_cond_wait(&r->work, &r->lock);
+	}
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+/* Execute all pending display lists, upload what they have drawn and carry
+ * out the deferred copies to windows. */
+static void
+raster_flush(Drw *drw)
+{
+	Raster *r = drw->raster;
+	Canvas *cv;
+	size_t i, k;
+
+	pthread_mutex_lock(&r->lock);
+	for (i = 0; i < r->ncanvases; i++) {
+		cv = r->canvases[i];
+		if (!cv->nops)
+			continue;
+		/* The server may still be reading an earlier upload. */
+		if (cv->putseq && (long)(LastKnownRequestProcessed(drw->dpy) - cv->putseq) < 0)
+			XSync(drw->dpy, False);
+		cv->putseq = 0;
+		r->queue[r->nqueue++] = cv;
+	}
+	r->next = 0;
+	r->pending = r->nqueue;
+	if (r->nqueue > 1)
+		pthread_cond_broadcast(&r->work);
+	raster_drain(r);
+	while (r->pending)
+		pthread_cond_wait(&r->done, &r->lock);
+	r->nqueue = 0;
+	pthread_mutex_unlock(&r->lock);
+
+	for (i = 0; i < r->ncanvases; i++) {
+		cv = r->canvases[i];
+		cv->x0 = MAX(cv->x0, 0);
+		cv->y0 = MAX(cv->y0, 0);
+		cv->x1 = cv->img ? MIN(cv->x1, cv->img->width) : 0;
+		cv->y1 = cv->img ? MIN(cv->y1, cv->img->height) : 0;
+		if (cv->x0 < cv->x1 && cv->y0 < cv->y1) {
+			if (r->useshm) {
+				cv->putseq = NextRequest(drw->dpy);
+				XShmPutImage(drw->dpy, cv->drawable, drw->gc, cv->img,
+					cv->x0, cv->y0, cv->x0, cv->y0,
+					cv->x1 - cv->x0, cv->y1 - cv->y0, False);
+			} else {
+				XPutImage(drw->dpy, cv->drawable, drw->gc, cv->img,
+					cv->x0, cv->y0, cv->x0, cv->y0,
+					cv->x1 - cv->x0, cv->y1 - cv->y0);
+			}
+		}
+		for (k = 0; k < cv->nmaps; k++)
+			XCopyArea(drw->dpy, cv->drawable, cv->maps[k].win, drw->gc,
+				cv->maps[k].x, cv->maps[k].y, cv->maps[k].w, cv->maps[k].h,
+				cv->maps[k].x, cv->maps[k].y);
+		cv->x0 = cv->x1 = 0;
+		cv->nops = cv->nglyphs = cv->nmaps = 0;
+	}
+}
+
+static void
+raster_fill(Drw *drw, int x, int y, int w, int h, unsigned long pixel)
+{
+	Canvas *cv = drw->raster->cur;
+	RasterOp *op;
+
+	if (!cv || w <= 0 || h <= 0)
+		return;
+	op = canvas_op(cv);
+	op->x = x;
+	op->y = y;
+	op->w = w;
+	op->h = h;
+	op->pixel = pixel;
+	op->nglyphs = 0;
+	canvas_damage(cv, x, y, w, h);
+}
+
+/* Return the atlas entry of 'glyph' of 'font', rendering it if necessary. */
+static AtlasGlyph *
+raster_glyph(Drw *drw, XftFont *font, FT_UInt glyph)
+{
+	Raster *r = drw->raster;
+	AtlasGlyph *g;
+	FT_Face face;
+	FT_Bitmap *bm;
+	unsigned char *src;
+	size_t i;
+	int x, y, w, h;
+
+	for (i = ((uintptr_t)font ^ glyph * 2654435761u) & (ATLASN - 1); r->glyphs[i].font;
+	     i = (i + 1) & (ATLASN - 1))
+		if (r->glyphs[i].font == font && r->glyphs[i].glyph == glyph)
+			return &r->glyphs[i];
+	g = &r->glyphs[i];
+
+	if (!(face = XftLockFace(font)))
+		return NULL;
+	if (FT_Load_Glyph(face, glyph, FT_LOAD_DEFAULT)
+	|| FT_Render_Glyph(face->glyph, FT_RENDER_MODE_NORMAL)) {
+		XftUnlockFace(font);
+		return NULL;
+	}
+	bm = &face->glyph->bitmap;
+	w = bm->width;
+	h = bm->rows;
+	/* Color fonts are never loaded, see xfont_create(). */
+	if ((bm->pixel_mode != FT_PIXEL_MODE_GRAY && bm->pixel_mode != FT_PIXEL_MODE_MONO)
+	|| w > ATLASW || h > ATLASH) {
+		XftUnlockFace(font);
+		return NULL;
+	}
+
+	if (r->ax + w > ATLASW) {
+		r->ax = 0;
+		r->ay += r->ah;
+		r->ah = 0;
+	}
+	if (r->ay + h > ATLASH || 2 * (r->nglyphs + 1) > ATLASN) {
+		/* Start over once the atlas is full, executing the display
+		 * lists referring to it first. */
+		XftUnlockFace(font);
+		raster_flush(drw);
+		memset(r->glyphs, 0, ATLASN * sizeof(AtlasGlyph));
+		r->nglyphs = r->ax = r->ay = r->ah = 0;
+		return raster_glyph(drw, font, glyph);
+	}
+	g->font = font;
+	g->glyph = glyph;
+	g->x = r->ax;
+	g->y = r->ay;
+	g->w = w;
+	g->h = h;
+	g->left = face->glyph->bitmap_left;
+	g->top = face->glyph->bitmap_top;
+	for (y = 0; y < g->h; y++) {
+		src = bm->buffer + (bm->pitch < 0 ? (g->h - 1 - y) * -bm->pitch : y * bm->pitch);
+		for (x = 0; x < g->w; x++)
+			r->atlas[(g->y + y) * ATLASW + g->x + x] = bm->pixel_mode == FT_PIXEL_MODE_MONO
+				? (src[x / 8] >> (7 - x % 8) & 1) * 0xff : src[x];
+	}
+	r->ax += g->w;
+	r->ah = MAX(r->ah, g->h);
+	r->nglyphs++;
+	XftUnlockFace(font);
+	return g;
+}
+
+/* Record blending the glyphs 'specs' in color 'fg'. */
+static void
+raster_text(Drw *drw, const XftGlyphFontSpec *specs, size_t n, unsigned long fg)
+{
+	Canvas *cv = drw->raster->cur;
+	AtlasGlyph *ag;
+	RasterGlyph *g;
+	RasterOp *op = NULL;
+	size_t k;
+
+	for (k = 0; cv && k < n; k++) {
+		if (!(ag = raster_glyph(drw, specs[k].font, specs[k].glyph)) || !ag->w || !ag->h)
+			continue;
+		/* raster_glyph() may have flushed the display list */
+		if (!op || !cv->nops) {
+			op = canvas_op(cv);
+			op->pixel = fg;
+			op->glyph = cv->nglyphs;
+			op->nglyphs = 0;
+		}
+		if (cv->nglyphs == cv->capglyphs) {
+			cv->capglyphs = cv->capglyphs ? 2 * cv->capglyphs : 256;
+			if (!(cv->glyphs = realloc(cv->glyphs, cv->capglyphs * sizeof(RasterGlyph))))
+				die("realloc:");
+		}
+		g = &cv->glyphs[cv->nglyphs++];
+		g->x = specs[k].x + ag->left;
+		g->y = specs[k].y - ag->top;
+		g->ax = ag->x;
+		g->ay = ag->y;
+		g->w = ag->w;
+		g->h = ag->h;
+		op = &cv->ops[cv->nops - 1];
+		op->nglyphs++;
+		canvas_damage(cv, g->x, g->y, g->w, g->h);
+	}
+}
+
 Drw *
 drw_create(Display *dpy, int screen, Window root, unsigned int w, unsigned int h, Visual *visual, unsigned int depth, Colormap cmap)
 {
@@ -79,7 +576,7 @@ drw_create(Display *dpy, int screen, Window root, unsigned int w, unsigned int h
 	drw->visual = visual;
   drw->depth = depth;
   drw->cmap = cmap;
-  drw->drawable = XCreatePixmap(dpy, root, w, h, depth);
+  drw->drawable = drw->pixmap = XCreatePixmap(dpy, root, w, h, depth);
   drw->gc = XCreateGC(dpy, drw->drawable, 0, NULL);
 	XSetLineAttributes(dpy, drw->gc, 1, LineSolid, CapButt, JoinMiter);
 
@@ -88,21 +585,160 @@ drw_create(Display *dpy, int screen, Window root, unsigned int w, unsigned int h
 
 void
 drw_resize(Drw *drw, unsigned int w, unsigned int h)
+{
+	if (!drw)
+		return;
+
+	if (drw->pixmap) {
+		drw_forget(drw, drw->pixmap);
+		XFreePixmap(drw->dpy, drw->pixmap);
+	}
+	drw->pixmap = XCreatePixmap(drw->dpy, drw->root, w, h, drw->depth);
+	drw_setdrawable(drw, drw->pixmap, w, h);
+}
+
+/* Direct the drawing functions to 'drawable' of size 'w' x 'h', which must
+ * have the depth of the Drw. The drawable remains owned by the caller. */
+void
+drw_setdrawable(Drw *drw, Drawable drawable, unsigned int w, unsigned int h)
 {
 	if (!drw)
 		return;
 
 	drw->w = w;
 	drw->h = h;
-	if (drw->drawable)
-		XFreePixmap(drw->dpy, drw->drawable);
-	drw->drawable = XCreatePixmap(drw->dpy, drw->root, w, h, drw->depth);
+	if (drw->raster) {
+		drw->raster->cur = canvas_get(drw, drawable);
+		canvas_resize(drw, drw->raster->cur, w, h);
+	}
+	if (drw->drawable == drawable)
+		return;
+	drw->drawable = drawable;
+	if (drw->xftdraw)
+		XftDrawChange(drw->xftdraw, drw->drawable);
+}
+
+/* Drop what is kept for 'drawable', which is about to be freed. */
+void
+drw_forget(Drw *drw, Drawable drawable)
+{
+	size_t i;
+
+	if (!drw || !drw->raster)
+		return;
+
+	for (i = 0; i < drw->raster->ncanvases; i++) {
+		if (drw->raster->canvases[i]->drawable != drawable)
+			continue;
+		if (drw->raster->cur == drw->raster->canvases[i])
+			drw->raster->cur = NULL;
+		canvas_free(drw, drw->raster->canvases[i]);
+	}
+}
+
+/*
+ * Rasterize rectangles and text on the client if 'on' is set, which pays off
+ * when the X server renders text slowly. The bars of several drawables are
+ * rasterized in parallel by 'nthreads' worker threads besides the calling one,
+ * at most one per additional processor. Only supported for 24-bit TrueColor
+ * visuals. Returns whether client-side rendering is in effect.
+ */
+int
+drw_clientside(Drw *drw, int on, unsigned int nthreads)
+{
+	Raster *r = drw ? drw->raster : NULL;
+	XImage *img;
+	size_t i;
+	long ncpu;
+	unsigned int host = 1;
+	int major, minor, bpp, event, error;
+	Bool pixmaps;
+
+	if (!drw)
+		return 0;
+	if (!on || r) {
+		if (!on && r) {
+			pthread_mutex_lock(&r->lock);
+			r->quit = 1;
+			pthread_cond_broadcast(&r->work);
+			pthread_mutex_unlock(&r->lock);
+			for (i = 0; i < r->nthreads; i++)
+				pthread_join(r->threads[i], NULL);
+			pthread_mutex_destroy(&r->lock);
+			pthread_cond_destroy(&r->work);
+			pthread_cond_destroy(&r->done);
+			for (i = 0; i < r->ncanvases; i++) {
+				canvas_free(drw, r->canvases[i]);
+				free(r->canvases[i]);
+			}
+			free(r->canvases);
+			free(r->queue);
+			free(r->threads);
+			free(r->atlas);
+			free(r->glyphs);
+			free(r);
+			drw->raster = NULL;
+		}
+		return !!drw->raster;
+	}
+	/* Pixels are written in host byte order. */
+	if (drw->visual->class != TrueColor || drw->visual->red_mask != 0xff0000
+	|| drw->visual->green_mask != 0xff00 || drw->visual->blue_mask != 0xff
+	|| (drw->depth != 24 && drw->depth != 32)
+	|| ImageByteOrder(drw->dpy) != (*(unsigned char *)&host ? LSBFirst : MSBFirst))
+		return 0;
+	if (!(img = XCreateImage(drw->dpy, drw->visual, drw->depth, ZPixmap, 0, NULL, 1, 1, 32, 0)))
+		return 0;
+	bpp = img->bits_per_pixel;
+	XDestroyImage(img);
+	if (bpp != 32)
+		return 0;
+
+	r = drw->raster = ecalloc(1, sizeof(Raster));
+	r->useshm = XShmQueryVersion(drw->dpy, &major, &minor, &pixmaps)
+		&& XQueryExtension(drw->dpy, "MIT-SHM", &r->shmopcode, &event, &error);
+	r->atlas = ecalloc(ATLASW * ATLASH, 1);
+	r->glyphs = ecalloc(ATLASN, sizeof(AtlasGlyph));
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->work, NULL);
+	pthread_cond_init(&r->done, NULL);
+	if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) > 0)
+		nthreads = MIN(nthreads, (unsigned long)ncpu - 1);
+	r->threads = ecalloc(nthreads ? nthreads : 1, sizeof(pthread_t));
+	for (i = 0; i < nthreads; i++)
+		if (!pthread_create(&r->threads[r->nthreads], NULL, raster_worker, r))
+			r->nthreads++;
+	drw->raster->cur = canvas_get(drw, drw->drawable);
+	canvas_resize(drw, drw->raster->cur, drw->w, drw->h);
+	return 1;
+}
+
+/* Carry out the drawing and copying requested since the last call. */
+void
+drw_flush(Drw *drw)
+{
+	if (drw && drw->raster)
+		raster_flush(drw);
 }
 
 void
 drw_free(Drw *drw)
 {
-	XFreePixmap(drw->dpy, drw->drawable);
+	size_t i;
+
+	for (i = 0; i < LENGTH(drw->widths); i++)
+		free(drw->widths[i].text);
+	for (i = 0; i < LENGTH(drw->runs); i++) {
+		free(drw->runs[i].text);
+		free(drw->runs[i].specs);
+	}
+	free(drw->specs);
+	drw_clientside(drw, 0, 0);
+	if (drw->xftdraw)
+		XftDrawDestroy(drw->xftdraw);
+	free(drw->bmp);
+	free(drw->astral);
+	XFreePixmap(drw->dpy, drw->pixmap);
 	XFreeGC(drw->dpy, drw->gc);
 	free(drw);
 }
@@ -189,6 +825,7 @@ drw_fontset_create(Drw* drw, const char *fonts[], size_t fontcount)
 			ret = cur;
 		}
 	}
+	drw->gen++; /* 'ret' may reuse the address of a freed fontset */
 	return (drw->fonts = ret);
 }
 
@@ -247,8 +884,22 @@ drw_setscheme(Drw *drw, Clr *scm)
 void
 drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int invert)
 {
+	unsigned long pixel;
+
 	if (!drw || !drw->scheme)
 		return;
+	if (drw->raster) {
+		pixel = invert ? drw->scheme[ColBg].pixel : drw->scheme[ColFg].pixel;
+		if (filled) {
+			raster_fill(drw, x, y, w, h, pixel);
+		} else {
+			raster_fill(drw, x, y, w, 1, pixel);
+			raster_fill(drw, x, y + h - 1, w, 1, pixel);
+			raster_fill(drw, x, y, 1, h, pixel);
+			raster_fill(drw, x + w - 1, y, 1, h, pixel);
+		}
+		return;
+	}
 	XSetForeground(drw->dpy, drw->gc, invert ? drw->scheme[ColBg].pixel : drw->scheme[ColFg].pixel);
 	if (filled)
 		XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
@@ -256,13 +907,238 @@ drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int
 		XDrawRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w - 1, h - 1);
 }
 
+static FntCov *
+astrallookup(Drw *drw, long cp)
+{
+	size_t i;
+
+	for (i = cp * 2654435761u & (drw->capastral - 1); drw->astral[i].font;
+	     i = (i + 1) & (drw->capastral - 1))
+		if (drw->astral[i].cp == cp)
+			return &drw->astral[i];
+	return &drw->astral[i];
+}
+
+static void
+astralinsert(Drw *drw, long cp, unsigned int font)
+{
+	FntCov *old, *e;
+	size_t i, cap;
+
+	/* Keep the load factor below 1/2. */
+	if (2 * (drw->nastral + 1) > drw->capastral) {
+		old = drw->astral;
+		cap = drw->capastral;
+		drw->capastral = cap ? 2 * cap : 64;
+		drw->astral = ecalloc(drw->capastral, sizeof(FntCov));
+		for (i = 0; i < cap; i++)
+			if (old[i].font)
+				*astrallookup(drw, old[i].cp) = old[i];
+		free(old);
+	}
+	if (!(e = astrallookup(drw, cp))->font)
+		drw->nastral++;
+	e->cp = cp;
+	e->font = font;
+}
+
+/* Forget the coverage of all codepoints if the fontset has changed. */
+static void
+covcheck(Drw *drw)
+{
+	if (drw->covfonts == drw->fonts)
+		return;
+	if (drw->bmp)
+		memset(drw->bmp, 0, 0x10000);
+	if (drw->astral)
+		memset(drw->astral, 0, drw->capastral * sizeof(FntCov));
+	drw->nastral = 0;
+	drw->covfonts = drw->fonts;
+}
+
+/* Remember that no font covers codepoint 'cp', not even after a search for
+ * fallback fonts. */
+static void
+covmiss(Drw *drw, long cp)
+{
+	covcheck(drw);
+	if (cp < 0x10000) {
+		if (!drw->bmp)
+			drw->bmp = ecalloc(0x10000, 1);
+		drw->bmp[cp] = COVMISS;
+	} else {
+		astralinsert(drw, cp, COVMISS);
+	}
+}
+
+/* Forget all misses, as a font which has just been appended to the fontset
+ * may cover them. */
+static void
+covclearmisses(Drw *drw)
+{
+	FntCov *old;
+	size_t i, cap;
+
+	if (drw->bmp)
+		for (i = 0; i < 0x10000; i++)
+			if (drw->bmp[i] == COVMISS)
+				drw->bmp[i] = 0;
+	if ((old = drw->astral)) {
+		cap = drw->capastral;
+		drw->astral = ecalloc(cap, sizeof(FntCov));
+		drw->nastral = 0;
+		for (i = 0; i < cap; i++)
+			if (old[i].font && old[i].font != COVMISS)
+				astralinsert(drw, old[i].cp, old[i].font);
+		free(old);
+	}
+}
+
+/*
+ * Return the first font of the fontset covering codepoint 'cp' or NULL if
+ * there is none. XftCharExists() is asked only once per codepoint and font.
+ * Codepoints known not to be covered by any font, not even a fallback, are
+ * reported as covered by the first font.
+ */
+static Fnt *
+fontfor(Drw *drw, long cp)
+{
+	Fnt *f;
+	unsigned int n;
+
+	covcheck(drw);
+	if (cp < 0x10000)
+		n = drw->bmp ? drw->bmp[cp] : 0;
+	else
+		n = drw->astral ? astrallookup(drw, cp)->font : 0;
+	if (n == COVMISS)
+		return drw->fonts;
+	if (n) {
+		for (f = drw->fonts; f && --n; f = f->next)
+			;
+		return f;
+	}
+
+	for (f = drw->fonts, n = 1; f; f = f->next, n++)
+		if (XftCharExists(drw->dpy, f->xfont, cp))
+			break;
+	if (!f || n >= COVMISS)
+		return f;
+	if (cp < 0x10000) {
+		if (!drw->bmp)
+			drw->bmp = ecalloc(0x10000, 1);
+		drw->bmp[cp] = n;
+	} else {
+		astralinsert(drw, cp, n);
+	}
+	return f;
+}
+
+/*
+ * Return the length of the longest prefix of the first 'len' bytes of 'text'
+ * which fits into 'w' pixels followed by an ellipsis ("..."), and write the
+ * width of both to 'ew', or 0 if not even the ellipsis fits. The prefix ends
+ * on a codepoint boundary. The advances of all glyphs are collected in a
+ * single pass and the cut point is searched for in their prefix sums.
+ */
+static size_t
+xfont_fit(Fnt *font, const char *text, size_t len, unsigned int w, unsigned int *ew)
+{
+	static unsigned int pos[1024 + 1]; /* x-offset of each glyph */
+	static size_t off[1024 + 1]; /* byte offset of each glyph */
+	XGlyphInfo ext;
+	FT_UInt glyph;
+	unsigned int ellw = 0;
+	size_t i, n, clen, lo, hi, mid;
+	long cp;
+
+	drw_font_getexts(font, "...", 3, &ellw, NULL);
+	if (ellw > w) {
+		*ew = 0;
+		return 0;
+	}
+	for (i = n = 0, pos[0] = off[0] = 0; i < len && n < LENGTH(pos) - 1; i += clen) {
+		if (!(clen = utf8decode(text + i, &cp, len - i)))
+			break; /* incomplete sequence */
+		glyph = XftCharIndex(font->dpy, font->xfont, cp);
+		XftGlyphExtents(font->dpy, font->xfont, &glyph, 1, &ext);
+		n++;
+		pos[n] = pos[n - 1] + ext.xOff;
+		off[n] = i + clen;
+	}
+	/* largest glyph count 'lo' such that pos[lo] + ellw <= w */
+	for (lo = 0, hi = n; lo < hi;) {
+		mid = (lo + hi + 1) / 2;
+		if (pos[mid] + ellw <= w)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	*ew = pos[lo] + ellw;
+	return off[lo];
+}
+
+/* Append the glyphs of the first 'len' bytes of 'text' to 'run', the first
+ * glyph's origin being at ('x', 'y'). */
+static void
+run_append(GlyphRun *run, Fnt *font, const char *text, size_t len, int x, int y)
+{
+	XGlyphInfo ext;
+	size_t i, clen;
+	long cp;
+
+	for (i = 0; i < len; i += clen) {
+		if (!(clen = utf8decode(text + i, &cp, len - i)))
+			break;
+		if (run->nspecs == run->cap) {
+			run->cap = run->cap ? 2 * run->cap : 64;
+			if (!(run->specs = realloc(run->specs, run->cap * sizeof(XftGlyphFontSpec))))
+				die("realloc:");
+		}
+		run->specs[run->nspecs].font = font->xfont;
+		run->specs[run->nspecs].glyph = XftCharIndex(font->dpy, font->xfont, cp);
+		run->specs[run->nspecs].x = x;
+		run->specs[run->nspecs].y = y;
+		XftGlyphExtents(font->dpy, font->xfont, &run->specs[run->nspecs].glyph, 1, &ext);
+		x += ext.xOff;
+		run->nspecs++;
+	}
+}
+
+/* Draw 'run' with a single request, its origin being at ('x', 'y'). */
+static void
+run_draw(Drw *drw, GlyphRun *run, int x, int y, int invert)
+{
+	size_t i;
+
+	if (!run->nspecs)
+		return;
+	if (drw->nspecs < run->nspecs) {
+		free(drw->specs);
+		drw->specs = ecalloc(run->nspecs, sizeof(XftGlyphFontSpec));
+		drw->nspecs = run->nspecs;
+	}
+	for (i = 0; i < run->nspecs; i++) {
+		drw->specs[i] = run->specs[i];
+		drw->specs[i].x += x;
+		drw->specs[i].y += y;
+	}
+	if (drw->raster) {
+		raster_text(drw, drw->specs, run->nspecs, drw->scheme[invert ? ColBg : ColFg].pixel);
+		return;
+	}
+	XftDrawGlyphFontSpec(drw->xftdraw, &drw->scheme[invert ? ColBg : ColFg],
+	                     drw->specs, run->nspecs);
+}
+
 int
 drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, int invert)
 {
 	char buf[1024];
-	int ty;
-	unsigned int ew;
-	XftDraw *d = NULL;
+	int ty, x0 = 0;
+	unsigned int ew, hash = 2166136261u;
+	GlyphRun *run = NULL;
+	const char *p;
 	Fnt *usedfont, *curfont, *nextfont;
 	size_t i, len;
 	int utf8strlen, utf8charlen, render = x || y || w || h;
@@ -280,11 +1156,35 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 	if (!render) {
 		w = ~w;
 	} else {
-		XSetForeground(drw->dpy, drw->gc, drw->scheme[invert ? ColFg : ColBg].pixel);
-		XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
-		d = XftDrawCreate(drw->dpy, drw->drawable, drw->visual, drw->cmap);
-		x += lpad;
+		if (drw->raster) {
+			raster_fill(drw, x, y, w, h, drw->scheme[invert ? ColFg : ColBg].pixel);
+		} else {
+			XSetForeground(drw->dpy, drw->gc, drw->scheme[invert ? ColFg : ColBg].pixel);
+			XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
+		}
+		if (!drw->raster && !drw->xftdraw)
+			drw->xftdraw = XftDrawCreate(drw->dpy, drw->drawable, drw->visual, drw->cmap);
+		x0 = x += lpad;
 		w -= lpad;
+
+		/* Draw the glyphs shaped by a previous call if any. Otherwise
+		 * they are collected in 'run' and drawn below. */
+		for (p = text; *p; p++) /* FNV-1a */
+			hash = (hash ^ (unsigned char)*p) * 16777619u;
+		hash = ((hash ^ w) * 16777619u ^ h) * 16777619u;
+		run = &drw->runs[hash % LENGTH(drw->runs)];
+		if (run->text && run->gen == drw->gen && run->fonts == drw->fonts
+		&& run->hash == hash && run->w == w && run->h == h && !strcmp(run->text, text)) {
+			run_draw(drw, run, x, y, invert);
+			return x + w;
+		}
+		free(run->text);
+		if (!(run->text = strdup(text)))
+			die("strdup:");
+		run->hash = hash;
+		run->w = w;
+		run->h = h;
+		run->nspecs = 0;
 	}
 
 	usedfont = drw->fonts;
@@ -294,43 +1194,40 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 		nextfont = NULL;
 		while (*text) {
 			utf8charlen = utf8decode(text, &utf8codepoint, UTF_SIZ);
-			for (curfont = drw->fonts; curfont; curfont = curfont->next) {
-				charexists = charexists || XftCharExists(drw->dpy, curfont->xfont, utf8codepoint);
-				if (charexists) {
-					if (curfont == usedfont) {
-						utf8strlen += utf8charlen;
-						text += utf8charlen;
-					} else {
-						nextfont = curfont;
-					}
-					break;
-				}
-			}
-
-			if (!charexists || nextfont)
+			/* If the fallback search below failed, the character is
+			 * drawn with the first font. */
+			if (!(curfont = fontfor(drw, utf8codepoint)) && charexists)
+				curfont = drw->fonts;
+			if (!(charexists = curfont != NULL))
 				break;
-			else
-				charexists = 0;
+			if (curfont != usedfont) {
+				nextfont = curfont;
+				break;
+			}
+			utf8strlen += utf8charlen;
+			text += utf8charlen;
+			charexists = 0;
 		}
 
 		if (utf8strlen) {
 			drw_font_getexts(usedfont, utf8str, utf8strlen, &ew, NULL);
-			/* shorten text if necessary */
-			for (len = MIN(utf8strlen, sizeof(buf) - 1); len && ew > w; len--)
-				drw_font_getexts(usedfont, utf8str, len, &ew, NULL);
+			len = MIN(utf8strlen, sizeof(buf) - 4);
+			if (ew > w || len < utf8strlen) {
+				/* shorten text and draw "..." to indicate so */
+				len = xfont_fit(usedfont, utf8str, len, w, &ew);
+				memcpy(buf, utf8str, len);
+				if (ew)
+					for (i = 0; i < 3; i++)
+						buf[len++] = '.';
+			} else {
+				memcpy(buf, utf8str, len);
+			}
 
 			if (len) {
-				memcpy(buf, utf8str, len);
 				buf[len] = '\0';
-				if (len < utf8strlen)
-          /* draw '.' to indicate shortened text */
-					for (i = len; i && i > len - 3; buf[--i] = '.')
-						; /* NOP */
-
 				if (render) {
-					ty = y + (h - usedfont->h) / 2 + usedfont->xfont->ascent;
-					XftDrawStringUtf8(d, &drw->scheme[invert ? ColBg : ColFg],
-					                  usedfont->xfont, x, ty, (XftChar8 *)buf, len);
+					ty = (h - usedfont->h) / 2 + usedfont->xfont->ascent;
+					run_append(run, usedfont, buf, len, x - x0, ty);
 				}
 				x += ew;
 				w -= ew;
@@ -373,15 +1270,24 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 					for (curfont = drw->fonts; curfont->next; curfont = curfont->next)
 						; /* NOP */
 					curfont->next = usedfont;
+					drw->gen++; /* text measured before may use the new font */
+					covclearmisses(drw);
 				} else {
 					xfont_free(usedfont);
 					usedfont = drw->fonts;
+					covmiss(drw, utf8codepoint);
 				}
+			} else {
+				covmiss(drw, utf8codepoint);
 			}
 		}
 	}
-	if (d)
-		XftDrawDestroy(d);
+	if (render) {
+		/* a fallback font may have been appended meanwhile */
+		run->gen = drw->gen;
+		run->fonts = drw->fonts;
+		run_draw(drw, run, x0, y, invert);
+	}
 
 	return x + (render ? w : 0);
 }
@@ -389,19 +1295,89 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 void
 drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h)
 {
+	Canvas *cv;
+
 	if (!drw)
 		return;
 
+	if ((cv = drw->raster ? drw->raster->cur : NULL) && (cv->nops || cv->x0 < cv->x1)) {
+		/* copy once the display list has been executed */
+		if (cv->nmaps == cv->capmaps) {
+			cv->capmaps = cv->capmaps ? 2 * cv->capmaps : 8;
+			if (!(cv->maps = realloc(cv->maps, cv->capmaps * sizeof(RasterMap))))
+				die("realloc:");
+		}
+		cv->maps[cv->nmaps++] = (RasterMap){win, x, y, w, h};
+		return;
+	}
 	XCopyArea(drw->dpy, drw->drawable, win, drw->gc, x, y, w, h, x, y);
-	XSync(drw->dpy, False);
+}
+
+/*
+ * Write up to 'n' codepoints known not to be covered by any font, not even a
+ * fallback, to 'cps' and return their total number. See
+ * drw_fontset_setmisses().
+ */
+size_t
+drw_fontset_getmisses(Drw *drw, long *cps, size_t n)
+{
+	size_t i, k = 0;
+
+	if (!drw || drw->covfonts != drw->fonts)
+		return 0;
+	if (drw->bmp)
+		for (i = 0; i < 0x10000; i++)
+			if (drw->bmp[i] == COVMISS && k++ < n)
+				cps[k - 1] = i;
+	for (i = 0; i < drw->capastral; i++)
+		if (drw->astral[i].font == COVMISS && k++ < n)
+			cps[k - 1] = drw->astral[i].cp;
+	return k;
+}
+
+/* Mark codepoints as not covered by any font, e.g. as obtained by
+ * drw_fontset_getmisses() in a previous session, sparing the search for
+ * fallback fonts. */
+void
+drw_fontset_setmisses(Drw *drw, const long *cps, size_t n)
+{
+	size_t i;
+
+	if (!drw || !drw->fonts)
+		return;
+	for (i = 0; i < n; i++)
+		if (cps[i] >= 0 && cps[i] <= 0x10FFFF)
+			covmiss(drw, cps[i]);
 }
 
 unsigned int
 drw_fontset_getwidth(Drw *drw, const char *text)
 {
+	TextWidth *tw;
+	unsigned int h = 2166136261u;
+	const char *p;
+
 	if (!drw || !drw->fonts || !text)
 		return 0;
-	return drw_text(drw, 0, 0, 0, 0, 0, text, 0);
+
+	/* FNV-1a */
+	for (p = text; *p; p++)
+		h = (h ^ (unsigned char)*p) * 16777619u;
+	tw = &drw->widths[h % LENGTH(drw->widths)];
+	if (tw->text && tw->gen == drw->gen && tw->fonts == drw->fonts
+	&& tw->hash == h && !strcmp(tw->text, text))
+		return tw->w;
+
+	free(tw->text);
+	tw->text = NULL;
+	tw->w = drw_text(drw, 0, 0, 0, 0, 0, text, 0);
+	/* measuring may append a fallback font and thus bump the generation */
+	tw->gen = drw->gen;
+	tw->fonts = drw->fonts;
+	tw->hash = h;
+	if (!(tw->text = strdup(text)))
+		die("strdup:");
+	return tw->w;
 }
 
 /*
@@ -17,6 +17,35 @@ typedef struct Fnt {
 enum { ColFg, ColBg, ColBorder }; /* Clr scheme index */
 typedef XftColor Clr;
 
+/* Glyphs of a text as rendered into a box of width 'w' and height 'h' by
+ * drw_text(), positioned relative to the box's origin after padding. Valid
+ * while 'gen' equals the generation of the Drw. */
+typedef struct {
+	char *text;
+	const Fnt *fonts;
+	unsigned int hash, gen, w, h;
+	XftGlyphFontSpec *specs;
+	size_t nspecs, cap;
+} GlyphRun;
+
+/* Font covering a codepoint outside the BMP, see Drw.astral. 'font' is the
+ * index of the font in the fontset plus 1. */
+typedef struct {
+	long cp;
+	unsigned int font;
+} FntCov;
+
+/* Cached width of a text as rendered with a fontset. Valid while 'gen'
+ * equals the generation of the Drw. */
+typedef struct {
+	char *text;
+	const Fnt *fonts;
+	unsigned int hash, gen, w;
+} TextWidth;
+
+/* Client-side rasterizer, see drw_clientside() */
+typedef struct Raster Raster;
+
 typedef struct {
 	unsigned int w, h;
 	Display *dpy;
@@ -25,21 +54,41 @@ typedef struct {
   Visual *visual;
   unsigned int depth;
   Colormap cmap;
-	Drawable drawable;
+	Drawable drawable; /* target of the drawing functions */
+	Pixmap pixmap; /* owned by the Drw, see drw_resize() */
 	GC gc;
 	Clr *scheme;
 	Fnt *fonts;
+	unsigned int gen; /* bumped whenever cached text widths may be stale */
+	TextWidth widths[256]; /* direct-mapped text width cache */
+	XftDraw *xftdraw; /* for 'drawable', created on demand */
+	GlyphRun runs[64]; /* direct-mapped glyph run cache */
+	XftGlyphFontSpec *specs; /* scratch buffer for drawing glyph runs */
+	size_t nspecs;
+	/* Codepoint coverage of 'covfonts': index of the first font covering a
+	 * codepoint plus 1, 0 if unknown or UCHAR_MAX if no font covers it. Dense for the BMP, an open
+	 * addressing hash table for the other planes. */
+	const Fnt *covfonts;
+	unsigned char *bmp;
+	FntCov *astral;
+	size_t nastral, capastral;
+	Raster *raster; /* NULL unless rasterizing on the client */
 } Drw;
 
 /* Drawable abstraction */
 Drw *drw_create(Display *dpy, int screen, Window win, unsigned int w, unsigned int h, Visual *visual, unsigned int depth, Colormap cmap);
 void drw_resize(Drw *drw, unsigned int w, unsigned int h);
+void drw_setdrawable(Drw *drw, Drawable drawable, unsigned int w, unsigned int h);
+void drw_forget(Drw *drw, Drawable drawable);
+int drw_clientside(Drw *drw, int on, unsigned int nthreads);
 void drw_free(Drw *drw);
 
 /* Fnt abstraction */
 Fnt *drw_fontset_create(Drw* drw, const char *fonts[], size_t fontcount);
 void drw_fontset_free(Fnt* set);
 unsigned int drw_fontset_getwidth(Drw *drw, const char *text);
+size_t drw_fontset_getmisses(Drw *drw, long *cps, size_t n);
+void drw_fontset_setmisses(Drw *drw, const long *cps, size_t n);
 int drw_fontset_utf8indexat(Drw* drw, const char *text, int at);
 void drw_font_getexts(Fnt *font, const char *text, unsigned int len, unsigned int *w, unsigned int *h);
 
@@ -61,6 +110,7 @@ int drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned in
 
 /* Map functions */
 void drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h);
+void drw_flush(Drw *drw);
 
 /* UTF-8 functions */
 size_t utf8decode(const char *c, long *u, size_t clen);
@@ -22,18 +22,25 @@
  */
 #include <errno.h>
 #include <locale.h>
+#include <regex.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <X11/cursorfont.h>
 #include <X11/keysym.h>
 #include <X11/Xatom.h>
 #include <X11/Xlib.h>
+#include <X11/Xlib-xcb.h>
 #include <X11/Xproto.h>
 #include <X11/Xutil.h>
 #ifdef XINERAMA
@@ -42,6 +49,7 @@
 #include <X11/Xft/Xft.h>
 
 #include "drw.h"
+#include "match.h"
 #include "util.h"
 
 /* macros */
@@ -51,13 +59,23 @@
                                * MAX(0, MIN((y)+(h),(m)->wy+(m)->wh) - MAX((y),(m)->wy)))
 #define ISVISIBLE(C)            ((C->tags & C->mon->tagset[C->mon->seltags]))
 #define LENGTH(X)               (sizeof X / sizeof X[0])
+#define MAXTAGS                 31
 #define MOUSEMASK               (BUTTONMASK|PointerMotionMask)
 #define WIDTH(X)                ((X)->w + 2 * (X)->bw)
 #define HEIGHT(X)               ((X)->h + 2 * (X)->bw)
+#define CFACTFIX(X)             ((unsigned long)((X)->cfact * 1024 + 0.5f)) /* cfact in fixed point */
 #define TAGMASK                 ((1 << LENGTH(tags)) - 1)
 #define TEXTW(X)                (drw_fontset_getwidth(drw, (X)) + lrpad)
 
+#define LONGBITS                (8 * sizeof(unsigned long))
+#define RULEWORDS               ((LENGTH(rules) + LONGBITS - 1) / LONGBITS)
+#define RULEBOL                 "\x02" /* '^' of rule patterns */
+#define RULEEOL                 "\x03" /* '$' of rule patterns */
+
 #define OPAQUE                  0xffU
+#define STATEENV                "DWM_STATEFD" /* state handed over on restart */
+#define STATEMAGIC              0x64776d7376UL
+#define STATEVERSION            1 /* bump when changing the records below */
 
 #ifndef VERSION
 #define VERSION "undefined"
@@ -74,6 +92,12 @@ enum { ClkTagBar, ClkLtSymbol, ClkStatusText, ClkWinTitle,
        ClkClientWin, ClkRootWin, ClkLast }; /* clicks */
 enum { ClientRegular = 1, ClientSwallowee, ClientSwallower }; /* client types wrt. swallowing */
 enum { ActionSet, ActionUnset, ActionToggle }; /* binary state changes */
+enum { PropWMClass, PropWMTransientFor, PropWMNormalHints, PropWMHints,
+       PropNetWMState, PropNetWMWindowType, PropLast }; /* properties fetched by manage() */
+enum { RuleClass, RuleInstance, RuleTitle, RuleLast }; /* fields matched by rules */
+enum { BarStatus, BarTags, BarLtSymbol, BarFlags, BarTitle, BarLast }; /* bar segments in drawing order */
+enum { DirtyLayout = 1 << 0, DirtyStack = 1 << 1, DirtyBar = 1 << 2,
+       DirtyClientList = 1 << 3 }; /* pending work of a monitor, see commit() */
 
 typedef union {
 	int i;
@@ -90,6 +114,11 @@ typedef struct {
 	const Arg arg;
 } Button;
 
+typedef struct {
+	int x, w; /* extent within the bar */
+	unsigned long key; /* hash of the inputs the segment was drawn from */
+} BarSeg;
+
 typedef struct Monitor Monitor;
 typedef struct Client Client;
 struct Client {
@@ -116,9 +145,17 @@ typedef struct {
 	const Arg arg;
 } Key;
 
+/* Geometry of a client computed by a layout, borders excluded */
+typedef struct {
+	Client *c;
+	int x, y, w, h;
+} Geom;
+
+/* arrange() computes the geometry of the i-th tiled client of a monitor into
+ * the i-th element of an array, see arrangemon(). */
 typedef struct {
 	const char *symbol;
-	void (*arrange)(Monitor *);
+	void (*arrange)(Monitor *, Geom *);
 } Layout;
 
 struct Monitor {
@@ -135,11 +172,21 @@ struct Monitor {
 	unsigned int tagset[2];
 	int showbar;
 	int topbar;
+	unsigned int dirty; /* pending work for commit() (Dirty* flags) */
+	unsigned long layoutid; /* layouthash() after the last arrange */
+	Window *order; /* stacking order applied by restackmon() */
+	unsigned int norder; /* 0 if unknown */
 	Client *clients; /* client list */
 	Client *sel;     /* active client */
 	Client *stack;   /* focus stack */
 	Monitor *next;
 	Window barwin; /* Window handle of the monitor's status bar */
+	unsigned int ntagged[MAXTAGS]; /* clients in 'clients' per tag, see tagcount() */
+	unsigned int nurgent[MAXTAGS]; /* urgent ones among these */
+	Pixmap barbuf; /* back buffer of barwin, sized barbufw x bh */
+	int barbufw;
+	int barvalid; /* barbuf holds the segments in 'seg' */
+	BarSeg seg[BarLast];
 	const Layout *lt[2];
 };
 
@@ -153,6 +200,36 @@ typedef struct {
 	int monitor;
 } Rule;
 
+/* Rules which may apply to windows of a class and instance, see
+ * rulecandidates(). */
+typedef struct {
+	char *key; /* "class\0instance" */
+	size_t len;
+	unsigned long *rules; /* bit set indexed like rules[] */
+} RuleCache;
+
+/* Property requests sent for a window in one go and their replies. Indexed
+ * by Prop* constants. */
+typedef struct {
+	xcb_get_property_cookie_t cookie[PropLast];
+	xcb_get_property_reply_t *reply[PropLast];
+} Props;
+
+/* File descriptor watched by the main loop. 'func' is called whenever 'fd'
+ * becomes readable and shall drain it. */
+typedef struct {
+	int fd;
+	void (*func)(void);
+} Source;
+
+/* Entry of the window table, see winlookup(). 'root' is the head of the
+ * swallow chain for swallowers and NULL for members of the client lists. */
+typedef struct {
+	Window win;
+	Client *c;
+	Client *root;
+} WinEntry;
+
 typedef struct Swallow Swallow;
 struct Swallow {
 	/* Window class name, instance name (WM_CLASS) and title
@@ -175,8 +252,54 @@ struct Swallow {
 	Swallow *next;
 };
 
+/* State handed over to the re-exec'd process on restart, see savestate().
+ * The header is followed by 'nmons' MonState, 'nclients' ClientState and
+ * 'nswallows' SwallowState records, by the 'nstack' windows of all focus
+ * stacks and by 'nmisses' codepoints not covered by the fonts, see
+ * drw_fontset_getmisses(). Pointers are replaced by window ids and monitor
+ * numbers. The record sizes and versions guard against reading the state of a
+ * differently built binary. */
+typedef struct {
+	unsigned long magic, size;
+	unsigned long layout, monsize, clientsize, swallowsize;
+	char version[32];
+	unsigned long nmons, nclients, nswallows, nstack, nmisses;
+	unsigned long selmon;
+	unsigned long fontsid; /* fontsid() of the fonts the misses refer to */
+} State;
+
+typedef struct {
+	float mfact;
+	int num, nmaster, gappx, showbar;
+	unsigned int seltags, sellt, tagset[2];
+	int lt[2]; /* indices into layouts */
+	Window sel;
+} MonState;
+
+/* Swallow chains are stored head first, followed by their swallowers. */
+typedef struct {
+	char name[256];
+	float mina, maxa, cfact;
+	int x, y, w, h, oldx, oldy, oldw, oldh;
+	int basew, baseh, incw, inch, maxw, maxh, minw, minh;
+	int bw, oldbw;
+	unsigned int tags;
+	int isfixed, isfloating, isurgent, neverfocus, oldstate, iscovertfullscreen, isfakefullscreen, isprotected;
+	int mon; /* Monitor.num */
+	int head; /* head of a swallow chain, i.e. member of the client list */
+	Window win;
+} ClientState;
+
+typedef struct {
+	char class[256], inst[256], title[256];
+	int decay;
+	Window client;
+} SwallowState;
+
 /* function declarations */
-static void applyrules(Client *c);
+static void addsource(Source *s);
+static void applyrules(Client *c, const char *class, const char *instance);
+static void applygeoms(const Geom *g, unsigned int n);
 static int applysizehints(Client *c, int *x, int *y, int *w, int *h, int interact);
 static void arrange(Monitor *m);
 static void arrangemon(Monitor *m);
@@ -188,6 +311,9 @@ static void checkotherwm(void);
 static void cleanup(void);
 static void cleanupmon(Monitor *mon);
 static void clientmessage(XEvent *e);
+static void coalesce(XEvent *evs, int n);
+static void commit(void);
+static void compilerules(void);
 static void configure(Client *c);
 static void configurenotify(XEvent *e);
 static void configurerequest(XEvent *e);
@@ -199,58 +325,86 @@ static Monitor *dirtomon(int dir);
 static void drawbar(Monitor *m);
 static void drawbars(void);
 static void enternotify(XEvent *e);
+static Window evwindow(XEvent *e);
 static void expose(XEvent *e);
 static int fakesignal(void);
 static void focus(Client *c);
+static unsigned long fnvhash(unsigned long h, const void *data, size_t len);
+static unsigned long fontsid(void);
+static void freerules(void);
 static void focusin(XEvent *e);
 static void focusmon(const Arg *arg);
 static void focusstack(const Arg *arg);
 static int getrootptr(int *x, int *y);
-static long getstate(Window w);
 static int gettextprop(Window w, Atom atom, char *text, unsigned int size);
 static void grabbuttons(Client *c, int focused);
 static void grabkeys(void);
+static void ignorecrossings(void);
 static void incnmaster(const Arg *arg);
 static void keypress(XEvent *e);
+static void loadstate(void);
 static void killclient(const Arg *arg);
-static void manage(Window w, XWindowAttributes *wa);
+static unsigned long layouthash(Monitor *m);
+static void manage(Window w, XWindowAttributes *wa, Props *p);
 static void mappingnotify(XEvent *e);
 static void maprequest(XEvent *e);
-static void monocle(Monitor *m);
+static void matchbit(unsigned int id, void *bits);
+static void monocle(Monitor *m, Geom *g);
 static void motionnotify(XEvent *e);
 static void movemouse(const Arg *arg);
 static void moveclient(const Arg *arg);
 static Client *nexttiled(Client *c);
 static void pop(Client *);
+static void propclass(Props *p, char *class, char *instance, size_t size);
 static void propertynotify(XEvent *e);
+static void propsfree(Props *p);
+static void propsizehints(Props *p, XSizeHints *size);
+static void propsreply(Props *p);
+static void propsrequest(Props *p, Window w);
+static void *propvalue(Props *p, int prop, Atom type, int format, int nitems);
+static int propwmhints(Props *p, XWMHints *wmh);
 static void quit(const Arg *arg);
+static void raiseclient(Client *c);
 static Monitor *recttomon(int x, int y, int w, int h);
+static int barseg(Monitor *m, int seg, int x, int w, unsigned long key);
+static void renderbar(Monitor *m);
 static void resize(Client *c, int x, int y, int w, int h, int interact);
 static void resizeclient(Client *c, int x, int y, int w, int h);
 static void resizemouse(const Arg *arg);
 static void restack(Monitor *m);
+static void restackmon(Monitor *m);
+static const unsigned long *rulecandidates(const char *class, const char *instance);
+static void rulematch(int f, const char *text, const unsigned long *only, unsigned long *bits);
 static void run(void);
+static void savestate(void);
 static void scan(void);
 static int sendevent(Client *c, Atom proto);
 static void sendmon(Client *c, Monitor *m);
 static void setclientstate(Client *c, long state);
 static void setfocus(Client *c);
+static void setgeom(Geom *g, Client *c, int x, int y, int w, int h);
 static void fakefullscreen(Client *c, int fullscreen);
 static void covertfullscreen(Client *c, int fullscreen);
 static void setgaps(const Arg *arg);
+static void setsizehints(Client *c, XSizeHints *size);
+static void settitle(Client *c, const char *class);
+static void setwindowtype(Client *c, Atom state, Atom wtype);
+static void setwmhints(Client *c, XWMHints *wmh);
 static void setlayout(const Arg *arg);
 static void setcfact(const Arg *arg);
 static void setmfact(const Arg *arg);
 static void setup(void);
 static void seturgent(Client *c, int urg);
 static void showhide(Client *c);
-static void sigchld(int unused);
-static void sighup(int unused);
-static void sigterm(int unused);
+static void sigchld(void);
+static void sighup(void);
+static void signals(void);
+static void sigterm(void);
 static void spawn(const Arg *arg);
 static void swal(Client *swer, Client *swee, int manage);
 static void swaldecayby(int decayby);
 static void swalmanage(Swallow *s, Window w, XWindowAttributes *wa);
+static void swalindex(void);
 static Swallow *swalmatch(Window w);
 static void swalmouse(const Arg *arg);
 static void swalreg(Client *c, const char* class, const char* inst, const char* title);
@@ -259,8 +413,11 @@ static void swalstop(Client *c, Client *root);
 static void swalstopsel(const Arg *unused);
 static void swalunreg(Client *c);
 static void tag(const Arg *arg);
+static void tagcount(Client *c, int n);
 static void tagmon(const Arg *arg);
-static void tile(Monitor *);
+static void textpropstr(XTextProperty *name, char *text, unsigned int size);
+static void tile(Monitor *m, Geom *g);
+static Client *tilecolumn(Monitor *m, Geom *g, Client *c, unsigned int n, int x, int w);
 static void togglebar(const Arg *arg);
 static void togglefloating(const Arg *arg);
 static void toggleprotected(const Arg *unused);
@@ -281,9 +438,16 @@ static void updatetitle(Client *c);
 static void updatewindowtype(Client *c);
 static void updatewmhints(Client *c);
 static void view(const Arg *arg);
+static void winadd(Client *c, Client *root);
+static void winchain(Client *head);
+static void windel(Window w);
+static size_t winhash(Window w);
+static WinEntry *winlookup(Window w);
 static Client *wintoclient(Window w);
 static int wintoclient2(Window w, Client **pc, Client **proot);
 static Monitor *wintomon(Window w);
+static void xevents(void);
+static void xsync(void);
 static int xerror(Display *dpy, XErrorEvent *ee);
 static int xerrordummy(Display *dpy, XErrorEvent *ee);
 static int xerrorstart(Display *dpy, XErrorEvent *ee);
@@ -325,7 +489,33 @@ Display *dpy;
 static Drw *drw;
 static Monitor *mons, *selmon; /* monitor list, selected monitor */
 static Window root, wmcheckwin;
+static xcb_connection_t *xcon; /* XCB connection underlying dpy */
 static Swallow *swallows; /* swallow pool (first elem of linked list) */
+static Matcher *swalmatcher[2]; /* class and instance filters of the pool */
+static Swallow **swalvec; /* swallow pool indexed by the matchers' ids */
+static size_t nswalvec;
+static unsigned long *swalbits[2]; /* scratch bit sets for swalmatch() */
+static int swaldirty; /* swallow pool changed since swalindex() */
+static int epfd = -1; /* epoll instance of the main loop */
+static Source xsrc = { -1, xevents }; /* X connection */
+static Source sigsrc = { -1, signals }; /* signalfd for SIGCHLD, SIGHUP and SIGTERM */
+static XEvent batch[256]; /* events drained from the X connection per dispatch */
+static unsigned long nsyncs; /* number of calls to xsync() */
+static BarSeg bardamage[BarLast]; /* segments drawn by renderbar() */
+static unsigned int nbardamage;
+static Matcher *rulematcher[RuleLast]; /* literal patterns of rules per field */
+static unsigned long *ruleany[RuleLast]; /* rules without pattern per field */
+static regex_t *ruleregex[RuleLast]; /* regex patterns of rules per field */
+static unsigned int *ruleregexidx[RuleLast], nruleregex[RuleLast]; /* rules thereof */
+static RuleCache rulecache[64];
+static WinEntry *wintab; /* open addressing hash table of all clients' windows */
+static unsigned int wintabbits; /* log2 of the table's capacity */
+static size_t wintabn; /* number of entries */
+static Geom *geoms; /* scratch array for layouts, see arrangemon() */
+static unsigned int ngeoms;
+static Window *stackbuf; /* scratch array for restackmon() */
+static unsigned int nstackbuf;
+static unsigned long crossserial; /* last request moving windows under the pointer, see ignorecrossings() */
 
 static int useargb = 0;
 static Visual *visual;
@@ -336,52 +526,76 @@ static Colormap cmap;
 #include "config.h"
 
 /* compile-time check if all tags fit into an unsigned int bit array. */
-struct NumTags { char limitexceeded[LENGTH(tags) > 31 ? -1 : 1]; };
+struct NumTags { char limitexceeded[LENGTH(tags) > MAXTAGS ? -1 : 1]; };
 
 /* function implementations */
 
+/*
+ * Register file descriptor with the main loop's epoll instance.
+ */
+void
+addsource(Source *s)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = s };
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, s->fd, &ev) < 0)
+		die("epoll_ctl:");
+}
+
 /*
  * Applies per-window rules defined in config.h
  */
 void
-applyrules(Client *c)
+applyrules(Client *c, const char *class, const char *instance)
 {
-	const char *class, *instance;
-	unsigned int i;
+	unsigned long title[RULEWORDS + 1], bits;
+	const unsigned long *cand;
+	unsigned int i, w;
+	int mon = -1, nmons = 0;
 	const Rule *r;
 	Monitor *m;
-	XClassHint ch = { NULL, NULL };
 
 	/* rule matching */
 	c->isfloating = 0;
 	c->tags = 0;
-	XGetClassHint(dpy, c->win, &ch);
-
-	/* Label clients which don't define a class or instance name as broken. */
-	class    = ch.res_class ? ch.res_class : broken;
-	instance = ch.res_name  ? ch.res_name  : broken;
-
-	for (i = 0; i < LENGTH(rules); i++) {
-		r = &rules[i];
-		if ((!r->title || strstr(c->name, r->title))
-		&& (!r->class || strstr(class, r->class))
-		&& (!r->instance || strstr(instance, r->instance)))
-		{
+	cand = rulecandidates(class, instance);
+	rulematch(RuleTitle, c->name, cand, title);
+	for (m = mons; m; m = m->next)
+		nmons++;
+	for (w = 0; w < RULEWORDS; w++) {
+		for (bits = cand[w] & title[w]; bits; bits &= bits - 1) {
+			i = w * LONGBITS + __builtin_ctzl(bits);
+			r = &rules[i];
 			c->isfloating = r->isfloating;
 			c->tags |= r->tags;
 			c->isprotected = r->isprotected;
-			for (m = mons; m && m->num != r->monitor; m = m->next);
-			if (m)
-				c->mon = m;
+			if (r->monitor >= 0 && r->monitor < nmons)
+				mon = r->monitor;
 		}
 	}
-	if (ch.res_class)
-		XFree(ch.res_class);
-	if (ch.res_name)
-		XFree(ch.res_name);
+	/* the last matching rule naming an existing monitor wins */
+	for (m = mons; m && m->num != mon; m = m->next);
+	if (m)
+		c->mon = m;
 	c->tags = c->tags & TAGMASK ? c->tags & TAGMASK : c->mon->tagset[c->mon->seltags];
 }
 
+/*
+ * Move and resize clients to the geometry computed by a layout. Requests are
+ * only sent for the clients whose geometry differs from their current one.
+ */
+void
+applygeoms(const Geom *g, unsigned int n)
+{
+	unsigned long req = NextRequest(dpy);
+
+	for (; n--; g++)
+		if (g->x != g->c->x || g->y != g->c->y || g->w != g->c->w || g->h != g->c->h)
+			resizeclient(g->c, g->x, g->y, g->w, g->h);
+	if (NextRequest(dpy) != req)
+		ignorecrossings();
+}
+
 int
 applysizehints(Client *c, int *x, int *y, int *w, int *h, int interact)
 {
@@ -455,39 +669,44 @@ applysizehints(Client *c, int *x, int *y, int *w, int *h, int interact)
 }
 
 /*
- * TODO: What does arrange() do?
+ * Schedule showing/hiding and rearranging the clients of monitor 'm' and
+ * restacking them, or of all monitors without restacking if 'm' is NULL. The
+ * work is carried out by the next commit().
  */
 void
 arrange(Monitor *m)
 {
-	if (m) {
-		showhide(m->stack);
-	}
-	else {
-		for (m = mons; m; m = m->next) {
-			showhide(m->stack);
-		}
-	}
-
-	if (m) {
-		arrangemon(m);
-		restack(m);
-	}
-	else {
+	if (m)
+		m->dirty |= DirtyLayout|DirtyStack|DirtyBar;
+	else
 		for (m = mons; m; m = m->next)
-			arrangemon(m);
-	}
+			m->dirty |= DirtyLayout;
 }
 
 /*
- * Call a monitor's arrange() function
+ * Call a monitor's arrange() function to compute the geometry of its tiled
+ * clients, then apply the result.
  */
 void
 arrangemon(Monitor *m)
 {
+	Client *c;
+	unsigned int n;
+
 	strncpy(m->ltsymbol, m->lt[m->sellt]->symbol, sizeof m->ltsymbol);
-	if (m->lt[m->sellt]->arrange)
-		m->lt[m->sellt]->arrange(m);
+	if (!m->lt[m->sellt]->arrange || layouthash(m) == m->layoutid)
+		return;
+	for (n = 0, c = nexttiled(m->clients); c; c = nexttiled(c->next), n++);
+	if (!n)
+		return;
+	if (n > ngeoms) {
+		free(geoms);
+		geoms = ecalloc(n, sizeof(Geom));
+		ngeoms = n;
+	}
+	m->lt[m->sellt]->arrange(m, geoms);
+	applygeoms(geoms, n);
+	m->layoutid = layouthash(m);
 }
 
 /*
@@ -499,6 +718,7 @@ attach(Client *c)
 {
 	c->next = c->mon->clients;
 	c->mon->clients = c;
+	tagcount(c, 1);
 }
 
 /*
@@ -516,6 +736,7 @@ attachbottom(Client *c)
 		below->next = c;
 	else
 		c->mon->clients = c;
+	tagcount(c, 1);
 }
 
 void
@@ -525,6 +746,34 @@ attachstack(Client *c)
 	c->mon->stack = c;
 }
 
+/*
+ * Return whether segment 'seg' of the bar of 'm', to be drawn at 'x' with
+ * width 'w' from inputs hashed to 'key', needs to be drawn. That is the case
+ * if any of these have changed, or if the segment overlaps a segment drawn
+ * before during the current renderbar(). Segments to be drawn are recorded
+ * as damage.
+ */
+int
+barseg(Monitor *m, int seg, int x, int w, unsigned long key)
+{
+	BarSeg *s = &m->seg[seg];
+	unsigned int i;
+
+	if (m->barvalid && s->x == x && s->w == w && s->key == key) {
+		for (i = 0; i < nbardamage; i++)
+			if (x < bardamage[i].x + bardamage[i].w && bardamage[i].x < x + w)
+				break;
+		if (i == nbardamage)
+			return 0;
+	}
+	s->x = x;
+	s->w = w;
+	s->key = key;
+	if (w > 0)
+		bardamage[nbardamage++] = *s;
+	return 1;
+}
+
 void
 buttonpress(XEvent *e)
 {
@@ -607,9 +856,9 @@ checkotherwm(void)
 	xerrorxlib = XSetErrorHandler(xerrorstart);
 	/* this causes an error if some other window manager is running */
 	XSelectInput(dpy, DefaultRootWindow(dpy), SubstructureRedirectMask);
-	XSync(dpy, False);
+	xsync();
 	XSetErrorHandler(xerror);
-	XSync(dpy, False);
+	xsync();
 }
 
 void
@@ -621,6 +870,7 @@ cleanup(void)
 	size_t i;
 
 	view(&a);
+	commit();
 	selmon->lt[selmon->sellt] = &foo;
 	for (m = mons; m; m = m->next)
 		while (m->stack)
@@ -634,7 +884,18 @@ cleanup(void)
 		free(scheme[i]);
 	XDestroyWindow(dpy, wmcheckwin);
 	drw_free(drw);
-	XSync(dpy, False);
+	close(epfd);
+	close(sigsrc.fd);
+	free(wintab);
+	free(geoms);
+	free(stackbuf);
+	freerules();
+	matcher_free(swalmatcher[0]);
+	matcher_free(swalmatcher[1]);
+	free(swalvec);
+	free(swalbits[0]);
+	free(swalbits[1]);
+	xsync();
 	XSetInputFocus(dpy, PointerRoot, RevertToPointerRoot, CurrentTime);
 	XDeleteProperty(dpy, root, netatom[NetActiveWindow]);
 }
@@ -652,6 +913,11 @@ cleanupmon(Monitor *mon)
 	}
 	XUnmapWindow(dpy, mon->barwin);
 	XDestroyWindow(dpy, mon->barwin);
+	if (mon->barbuf) {
+		drw_forget(drw, mon->barbuf);
+		XFreePixmap(dpy, mon->barbuf);
+	}
+	free(mon->order);
 	free(mon);
 }
 
@@ -697,6 +963,151 @@ clientmessage(XEvent *e)
 	}
 }
 
+/*
+ * Drop events from a batch which are superseded by later events for the same
+ * window: all but the last Expose, all but the last PropertyNotify per atom
+ * and state, and ConfigureRequests whose fields are all requested again by a
+ * later one. Map, unmap and destroy events act as barriers across which
+ * nothing is dropped. Dropped events get type 0, for which there's no
+ * handler.
+ */
+void
+coalesce(XEvent *evs, int n)
+{
+	static XEvent *seen[LENGTH(batch)]; /* latest coalescable events */
+	int i, j, nseen = 0;
+	XEvent *e, *l;
+	Window w;
+
+	for (i = n - 1; i >= 0; i--) {
+		e = &evs[i];
+		w = evwindow(e);
+		switch (e->type) {
+		case MapRequest: /* fallthrough */
+		case UnmapNotify: /* fallthrough */
+		case DestroyNotify:
+			for (j = 0; j < nseen; j++)
+				if (evwindow(seen[j]) == w)
+					seen[j--] = seen[--nseen];
+			break;
+		case ConfigureRequest: /* fallthrough */
+		case Expose: /* fallthrough */
+		case PropertyNotify:
+			/* Changes of the root window's name are commands (see
+			 * fakesignal()) and must not be dropped. */
+			if (e->type == PropertyNotify && w == root)
+				break;
+			for (j = 0; j < nseen; j++) {
+				l = seen[j];
+				if (l->type == e->type && evwindow(l) == w
+				&& (e->type != PropertyNotify
+				|| (l->xproperty.atom == e->xproperty.atom
+				&& l->xproperty.state == e->xproperty.state)))
+					break;
+			}
+			if (j == nseen)
+				seen[nseen++] = e;
+			else if (e->type != ConfigureRequest
+			|| !(e->xconfigurerequest.value_mask & ~seen[j]->xconfigurerequest.value_mask))
+				e->type = 0;
+			break;
+		}
+	}
+}
+
+/*
+ * Carry out the work scheduled by arrange(), restack(), drawbar() and friends
+ * since the last commit, at most once per monitor, and flush the requests.
+ * Handlers only mark monitors dirty; commit() runs after each event batch.
+ */
+void
+commit(void)
+{
+	Monitor *m;
+	unsigned int dirty = 0;
+	unsigned long shown = NextRequest(dpy);
+#ifdef STATS
+	unsigned long req = NextRequest(dpy), ns = nsyncs;
+#endif
+
+	/* Show and hide all clients before arranging any monitor. Windows
+	 * moving in and out of sight are no crossings of the user's. */
+	for (m = mons; m; m = m->next)
+		if (m->dirty & DirtyLayout)
+			showhide(m->stack);
+	if (NextRequest(dpy) != shown)
+		ignorecrossings();
+	for (m = mons; m; m = m->next)
+		if (m->dirty & DirtyLayout)
+			arrangemon(m);
+#ifdef STATS
+	if (NextRequest(dpy) != req)
+		fprintf(stderr, "dwm: arrange: %lu requests, %lu XSync calls\n",
+			NextRequest(dpy) - req, nsyncs - ns);
+#endif
+	for (m = mons; m; m = m->next) {
+		if (m->dirty & DirtyStack)
+			restackmon(m);
+		if (m->dirty & DirtyBar)
+			renderbar(m);
+		dirty |= m->dirty;
+		m->dirty = 0;
+	}
+	drw_flush(drw);
+	if (dirty & DirtyClientList)
+		updateclientlist();
+	XFlush(dpy);
+}
+
+/*
+ * Compile the patterns of rules[] into a matcher per rule field, see
+ * rulematch(). Literal patterns of all rules are matched in a single pass over
+ * a text, '^' and '$' anchors being translated to markers framing the text.
+ * Patterns enclosed in slashes are POSIX extended regular expressions.
+ */
+void
+compilerules(void)
+{
+	const char *pat[RuleLast], *p;
+	char buf[256 + 3];
+	unsigned int i, f;
+	size_t len;
+	int bol, eol;
+
+	for (f = 0; f < RuleLast; f++) {
+		rulematcher[f] = matcher_create();
+		ruleany[f] = ecalloc(RULEWORDS + 1, sizeof(unsigned long));
+		ruleregex[f] = ecalloc(LENGTH(rules) + 1, sizeof(regex_t));
+		ruleregexidx[f] = ecalloc(LENGTH(rules) + 1, sizeof(unsigned int));
+	}
+	for (i = 0; i < LENGTH(rules); i++) {
+		pat[RuleClass] = rules[i].class;
+		pat[RuleInstance] = rules[i].instance;
+		pat[RuleTitle] = rules[i].title;
+		for (f = 0; f < RuleLast; f++) {
+			if (!(p = pat[f])) {
+				ruleany[f][i / LONGBITS] |= 1UL << i % LONGBITS;
+				continue;
+			}
+			len = strlen(p);
+			if (len >= 2 && p[0] == '/' && p[len - 1] == '/') {
+				snprintf(buf, sizeof buf, "%.*s", (int)len - 2, p + 1);
+				if (regcomp(&ruleregex[f][nruleregex[f]], buf, REG_EXTENDED|REG_NOSUB))
+					die("dwm: invalid regular expression in rule: %s", p);
+				ruleregexidx[f][nruleregex[f]++] = i;
+			} else {
+				bol = p[0] == '^';
+				eol = len > (size_t)bol && p[len - 1] == '$';
+				snprintf(buf, sizeof buf, "%s%.*s%s", bol ? RULEBOL : "",
+					(int)(len - bol - eol), p + bol, eol ? RULEEOL : "");
+				matcher_add(rulematcher[f], buf, i);
+			}
+		}
+	}
+	for (f = 0; f < RuleLast; f++)
+		matcher_compile(rulematcher[f]);
+}
+
 /*
  * Inform client window about it's (new) geometry via synthetic ConfigureNotify
  */
@@ -734,7 +1145,6 @@ configurenotify(XEvent *e)
 		sw = ev->width;
 		sh = ev->height;
 		if (updategeom() || dirty) {
-			drw_resize(drw, sw, bh);
 			updatebars();
 			for (m = mons; m; m = m->next) {
 				for (c = m->clients; c; c = c->next)
@@ -832,7 +1242,6 @@ configurerequest(XEvent *e)
 		XConfigureWindow(dpy, ev->window, ev->value_mask, &wc);
 		break;
 	}
-	XSync(dpy, False);
 }
 
 Monitor *
@@ -874,8 +1283,9 @@ destroynotify(XEvent *e)
 		for (swee = root; swee->swallowedby != c; swee = swee->swallowedby);
 		swee->swallowedby = NULL;
 
+		windel(c->win);
 		free(c);
-		updateclientlist();
+		root->mon->dirty |= DirtyClientList;
 		break;
 	}
 }
@@ -890,6 +1300,8 @@ detach(Client *c)
 
 	/* Find client whose 'next' points 'c' and link to 'c->next' instead. */
 	for (tc = &c->mon->clients; *tc && *tc != c; tc = &(*tc)->next);
+	if (*tc)
+		tagcount(c, -1);
 	*tc = c->next;
 }
 
@@ -929,91 +1341,116 @@ dirtomon(int dir)
 	return m;
 }
 
+/*
+ * Schedule redrawing the bar of monitor 'm'. See commit().
+ */
 void
 drawbar(Monitor *m)
 {
-	// TODO: Simplify drawbar()
+	m->dirty |= DirtyBar;
+}
+
+void
+drawbars(void)
+{
+	Monitor *m;
+
+	for (m = mons; m; m = m->next)
+		drawbar(m);
+}
+
+void
+renderbar(Monitor *m)
+{
+	// TODO: Simplify renderbar()
 	//       The current implementation is a leftover from the original
 	//       which uses three color schemes.
 
 	int x, w, sw, pad = 0;
 	int boxs = drw->fonts->h / 9;
 	int boxw = drw->fonts->h / 6 + 2;
-	unsigned int i, occ = 0, urg = 0;
-	Client *c;
+	unsigned int i, occ = 0, urg = 0, flags[4];
+	unsigned long key;
+
+	/* Each segment is only drawn if its inputs have changed, relying on
+	 * the back buffer to hold the others. Drawn segments are copied to the
+	 * bar window individually. */
+	drw_setdrawable(drw, m->barbuf, m->barbufw, bh);
+	nbardamage = 0;
 
 	/* draw status first so it can be overdrawn by tags later */
 	drw_setscheme(drw, scheme[SchemeNorm]);
 	sw = TEXTW(stext) - lrpad/2 + statusrpad;
-	if (m == selmon) { /* status is only drawn on selected monitor */
-		drw_text(drw, m->ww - sw, 0, sw, bh, lrpad/2, stext, 0);
-	} else {
-		drw_setscheme(drw, scheme[SchemeNorm]);
-		drw_rect(drw, m->ww - sw, 0, sw, bh, 1, 1);
+	key = fnvhash(m == selmon, stext, m == selmon ? strlen(stext) : 0);
+	if (barseg(m, BarStatus, m->ww - sw, sw, key)) {
+		if (m == selmon) { /* status is only drawn on selected monitor */
+			drw_text(drw, m->ww - sw, 0, sw, bh, lrpad/2, stext, 0);
+		} else {
+			drw_setscheme(drw, scheme[SchemeNorm]);
+			drw_rect(drw, m->ww - sw, 0, sw, bh, 1, 1);
+		}
 	}
 
-	for (c = m->clients; c; c = c->next) {
-		occ |= c->tags;
-		if (c->isurgent)
-			urg |= c->tags;
+	for (i = 0, w = 0; i < LENGTH(tags); i++) {
+		occ |= !!m->ntagged[i] << i;
+		urg |= !!m->nurgent[i] << i;
+		w += TEXTW(tags[i]);
 	}
-	x = 0;
-	for (i = 0; i < LENGTH(tags); i++) {
-		w = TEXTW(tags[i]);
-		drw_setscheme(drw, scheme[m->tagset[m->seltags] & 1 << i ? SchemeSel : SchemeNorm]);
-		drw_text(drw, x, 0, w, bh, lrpad / 2, tags[i], urg & 1 << i);
-		if (occ & 1 << i)
-			drw_rect(drw, x + boxs, boxs, boxw, boxw,
-				m == selmon && selmon->sel && selmon->sel->tags & 1 << i,
-				urg & 1 << i);
-		x += w;
+	flags[0] = occ;
+	flags[1] = urg;
+	flags[2] = m->tagset[m->seltags];
+	flags[3] = m == selmon && selmon->sel ? selmon->sel->tags : 0;
+	if (barseg(m, BarTags, 0, w, fnvhash(0, flags, sizeof flags))) {
+		x = 0;
+		for (i = 0; i < LENGTH(tags); i++) {
+			w = TEXTW(tags[i]);
+			drw_setscheme(drw, scheme[m->tagset[m->seltags] & 1 << i ? SchemeSel : SchemeNorm]);
+			drw_text(drw, x, 0, w, bh, lrpad / 2, tags[i], urg & 1 << i);
+			if (occ & 1 << i)
+				drw_rect(drw, x + boxs, boxs, boxw, boxw,
+					m == selmon && selmon->sel && selmon->sel->tags & 1 << i,
+					urg & 1 << i);
+			x += w;
+		}
 	}
+	x = m->seg[BarTags].w;
 	w = blw = TEXTW(m->ltsymbol);
 	drw_setscheme(drw, scheme[SchemeNorm]);
-	x = drw_text(drw, x, 0, w, bh, lrpad / 2, m->ltsymbol, 0);
+	if (barseg(m, BarLtSymbol, x, w, fnvhash(0, m->ltsymbol, strlen(m->ltsymbol))))
+		drw_text(drw, x, 0, w, bh, lrpad / 2, m->ltsymbol, 0);
+	x += w;
 
 	/* Draw status symbols next to ltsymbol. */
-	if (m->sel) {
-		if (m->sel->swallowedby) {
-			w = TEXTW(swalsymbol);
-			x = drw_text(drw, x, 0, w, bh, lrpad / 2, swalsymbol, 0);
-		}
-
-		if (m->sel->isprotected) {
-			w = TEXTW(protectedsymbol);
-			x = drw_text(drw, x, 0, w, bh, lrpad / 2, protectedsymbol, 0);
-		}
-		
-		if (m->sel->isfakefullscreen) {
-			w = TEXTW(fakefullscreensymbol);
-			x = drw_text(drw, x, 0, w, bh, lrpad / 2, fakefullscreensymbol, 0);
-		}
+	flags[0] = m->sel && m->sel->swallowedby;
+	flags[1] = m->sel && m->sel->isprotected;
+	flags[2] = m->sel && m->sel->isfakefullscreen;
+	w = (flags[0] ? TEXTW(swalsymbol) : 0) + (flags[1] ? TEXTW(protectedsymbol) : 0)
+		+ (flags[2] ? TEXTW(fakefullscreensymbol) : 0);
+	if (barseg(m, BarFlags, x, w, fnvhash(0, flags, 3 * sizeof *flags))) {
+		if (flags[0])
+			x = drw_text(drw, x, 0, TEXTW(swalsymbol), bh, lrpad / 2, swalsymbol, 0);
+		if (flags[1])
+			x = drw_text(drw, x, 0, TEXTW(protectedsymbol), bh, lrpad / 2, protectedsymbol, 0);
+		if (flags[2])
+			x = drw_text(drw, x, 0, TEXTW(fakefullscreensymbol), bh, lrpad / 2, fakefullscreensymbol, 0);
 	}
-	
-	/* Draw symbol for protected windows. */
-	
+	x = m->seg[BarFlags].x + m->seg[BarFlags].w;
 
-	if ((w = m->ww - sw - x) > bh) { // larger than bar height? the fuck?
-		if (m->sel) {
-			drw_setscheme(drw, scheme[SchemeNorm]);
-			pad = MAX(lrpad / 2, ((m->ww - (int)TEXTW(m->sel->name))/2 - x));
+	w = MAX(m->ww - sw - x, 0);
+	if (w > bh && m->sel) // larger than bar height? the fuck?
+		pad = MAX(lrpad / 2, ((m->ww - (int)TEXTW(m->sel->name))/2 - x));
+	key = w > bh && m->sel ? fnvhash(pad, m->sel->name, strlen(m->sel->name)) : 0;
+	if (barseg(m, BarTitle, x, w, key)) {
+		drw_setscheme(drw, scheme[SchemeNorm]);
+		if (w > bh && m->sel)
 			drw_text(drw, x, 0, w, bh, pad, m->sel->name, 0);
-		}
-		else {
-			drw_setscheme(drw, scheme[SchemeNorm]);
+		else if (w > 0)
 			drw_rect(drw, x, 0, w, bh, 1, 1);
-		}
 	}
-	drw_map(drw, m->barwin, 0, 0, m->ww, bh);
-}
-
-void
-drawbars(void)
-{
-	Monitor *m;
 
-	for (m = mons; m; m = m->next)
-		drawbar(m);
+	m->barvalid = 1;
+	for (i = 0; i < nbardamage; i++)
+		drw_map(drw, m->barwin, bardamage[i].x, 0, bardamage[i].w, bh);
 }
 
 void
@@ -1023,6 +1460,10 @@ enternotify(XEvent *e)
 	Monitor *m;
 	XCrossingEvent *ev = &e->xcrossing;
 
+	/* Ignore crossings caused by our own requests rather than the user,
+	 * comparing serials modulo wraparound. */
+	if ((long)(ev->serial - crossserial) <= 0)
+		return;
 	if ((ev->mode != NotifyNormal || ev->detail == NotifyInferior) && ev->window != root)
 		return;
 	c = wintoclient(ev->window);
@@ -1035,15 +1476,38 @@ enternotify(XEvent *e)
 	focus(c);
 }
 
+/*
+ * Return the window an event refers to, which for events selected via
+ * substructure masks differs from the window it is reported on.
+ */
+Window
+evwindow(XEvent *e)
+{
+	switch (e->type) {
+	case ConfigureRequest: return e->xconfigurerequest.window;
+	case DestroyNotify:    return e->xdestroywindow.window;
+	case MapRequest:       return e->xmaprequest.window;
+	case UnmapNotify:      return e->xunmap.window;
+	default:               return e->xany.window;
+	}
+}
+
 void
 expose(XEvent *e)
 {
 	Monitor *m;
 	XExposeEvent *ev = &e->xexpose;
 
-	/* only draw the last contiguous expose indicated by count=0. */
-	if (ev->count == 0 && (m = wintomon(ev->window)))
-		drawbar(m);
+	/* only draw the last contiguous expose indicated by count=0. The back
+	 * buffer is up to date unless a redraw is pending anyway. */
+	if (ev->count == 0 && (m = wintomon(ev->window))) {
+		if (m->barvalid && ev->window == m->barwin) {
+			drw_setdrawable(drw, m->barbuf, m->barbufw, bh);
+			drw_map(drw, m->barwin, 0, 0, m->ww, bh);
+		} else {
+			drawbar(m);
+		}
+	}
 }
 
 int
@@ -1122,6 +1586,53 @@ fakesignal(void)
 	return 1;
 }
 
+/* FNV-1a, continuing from 'h' */
+unsigned long
+fnvhash(unsigned long h, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	for (h ^= 2166136261u; len--; p++)
+		h = (h ^ *p) * 16777619u;
+	return h;
+}
+
+/* Identify the configured fonts, see savestate(). */
+unsigned long
+fontsid(void)
+{
+	unsigned long h = 2166136261u;
+	const char *p;
+	size_t i;
+
+	for (i = 0; i < LENGTH(fonts); i++)
+		for (p = fonts[i]; ; p++) {
+			h = (h ^ (unsigned char)*p) * 16777619u; /* FNV-1a */
+			if (!*p)
+				break;
+		}
+	return h;
+}
+
+void
+freerules(void)
+{
+	unsigned int i, f;
+
+	for (f = 0; f < RuleLast; f++) {
+		matcher_free(rulematcher[f]);
+		for (i = 0; i < nruleregex[f]; i++)
+			regfree(&ruleregex[f][i]);
+		free(ruleregex[f]);
+		free(ruleregexidx[f]);
+		free(ruleany[f]);
+	}
+	for (i = 0; i < LENGTH(rulecache); i++) {
+		free(rulecache[i].key);
+		free(rulecache[i].rules);
+	}
+}
+
 void
 focus(Client *c)
 {
@@ -1234,32 +1745,12 @@ getrootptr(int *x, int *y)
 	return XQueryPointer(dpy, root, &dummy, &dummy, x, y, &di, &di, &dui);
 }
 
-long
-getstate(Window w)
-{
-	int format;
-	long result = -1;
-	unsigned char *p = NULL;
-	unsigned long n, extra;
-	Atom real;
-
-	if (XGetWindowProperty(dpy, w, wmatom[WMState], 0L, 2L, False, wmatom[WMState],
-		&real, &format, &n, &extra, (unsigned char **)&p) != Success)
-		return -1;
-	if (n != 0)
-		result = *p;
-	XFree(p);
-	return result;
-}
-
 /*
  * Write 'w'indow property 'atom' to 'text' (limited to 'size' chars).
  */
 int
 gettextprop(Window w, Atom atom, char *text, unsigned int size)
 {
-	char **list = NULL;
-	int n;
 	XTextProperty name;
 
 	if (!text || size == 0)
@@ -1267,23 +1758,37 @@ gettextprop(Window w, Atom atom, char *text, unsigned int size)
 	text[0] = '\0';
 	if (!XGetTextProperty(dpy, w, &name, atom) || !name.nitems)
 		return 0;
-	if (name.encoding == XA_STRING)
-		strncpy(text, (char *)name.value, size - 1);
+	textpropstr(&name, text, size);
+	XFree(name.value);
+	return 1;
+}
+
+/*
+ * Convert text property 'name' to a null-terminated string of at most 'size'
+ * bytes in 'text'.
+ */
+void
+textpropstr(XTextProperty *name, char *text, unsigned int size)
+{
+	char **list = NULL;
+	int n;
+
+	text[0] = '\0';
+	if (name->encoding == XA_STRING)
+		strncpy(text, (char *)name->value, size - 1);
 	else {
-		if (XmbTextPropertyToTextList(dpy, &name, &list, &n) >= Success && n > 0 && *list) {
+		if (XmbTextPropertyToTextList(dpy, name, &list, &n) >= Success && n > 0 && *list) {
 			strncpy(text, *list, size - 1);
 			XFreeStringList(list);
 		}
 	}
 	text[size - 1] = '\0';
-	XFree(name.value);
-	return 1;
 }
 
 void
 grabbuttons(Client *c, int focused)
 {
-	updatenumlockmask();
+	/* numlockmask is kept up to date by grabkeys() */
 	{
 		unsigned int i, j;
 		unsigned int modifiers[] = { 0, LockMask, numlockmask, numlockmask|LockMask };
@@ -1319,6 +1824,18 @@ grabkeys(void)
 	}
 }
 
+/*
+ * Make enternotify() ignore the crossings caused by the requests sent so far.
+ * Crossings carry the serial of the last request processed, so a no-op is sent
+ * such that crossings the user causes afterwards carry a greater one.
+ */
+void
+ignorecrossings(void)
+{
+	crossserial = NextRequest(dpy) - 1;
+	XNoOp(dpy);
+}
+
 void
 incnmaster(const Arg *arg)
 {
@@ -1370,12 +1887,232 @@ killclient(const Arg *arg)
 		XSetErrorHandler(xerrordummy);
 		XSetCloseDownMode(dpy, DestroyAll);
 		XKillClient(dpy, selmon->sel->win);
-		XSync(dpy, False);
+		xsync();
 		XSetErrorHandler(xerror);
 		XUngrabServer(dpy);
 	}
 }
 
+/*
+ * Fingerprint the inputs of the layout of 'm' and the current geometry of its
+ * tiled clients. Arranging is a no-op while it stays the same.
+ */
+unsigned long
+layouthash(Monitor *m)
+{
+	Client *c;
+	unsigned long h;
+
+	h = fnvhash(0, &m->lt[m->sellt], sizeof(Layout *));
+	h = fnvhash(h, &m->mfact, sizeof m->mfact);
+	h = fnvhash(h, (int[]){ m->nmaster, m->gappx, m->wx, m->wy, m->ww, m->wh }, 6 * sizeof(int));
+	for (c = nexttiled(m->clients); c; c = nexttiled(c->next)) {
+		h = fnvhash(h, &c, sizeof c);
+		h = fnvhash(h, (float[]){ c->cfact, c->mina, c->maxa }, 3 * sizeof(float));
+		h = fnvhash(h, (int[]){ c->x, c->y, c->w, c->h, c->bw, c->basew, c->baseh,
+			c->incw, c->inch, c->maxw, c->maxh, c->minw, c->minh }, 13 * sizeof(int));
+	}
+	return h;
+}
+
+/*
+ * Adopt the state handed over by savestate() of the process we have been
+ * exec'd from, if any. Windows which vanished in the meantime are dropped;
+ * the first surviving member of a swallow chain takes the chain's place.
+ * Anything left unmanaged is picked up by scan().
+ */
+void
+loadstate(void)
+{
+	State st;
+	MonState *ms;
+	ClientState *cs;
+	SwallowState *ss;
+	Window *stack;
+	xcb_get_window_attributes_cookie_t *ck;
+	xcb_get_window_attributes_reply_t *r;
+	Client **cl, *c, *head, *prev;
+	Monitor *m;
+	Swallow *s, **ps;
+	struct stat sb;
+	const char *env;
+	char *buf;
+	unsigned long i, j, k;
+	int fd;
+
+	if (!(env = getenv(STATEENV)))
+		return;
+	fd = atoi(env);
+	unsetenv(STATEENV);
+	if (fstat(fd, &sb) < 0 || (size_t)sb.st_size < sizeof st
+	|| (buf = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return;
+	}
+	close(fd);
+	memcpy(&st, buf, sizeof st);
+	if (st.magic == STATEMAGIC && (st.layout != STATEVERSION
+	|| st.monsize != sizeof(MonState) || st.clientsize != sizeof(ClientState)
+	|| st.swallowsize != sizeof(SwallowState)
+	|| strncmp(st.version, VERSION, sizeof st.version - 1))) {
+		fputs("warning: ignoring state of incompatible previous instance\n", stderr);
+		munmap(buf, sb.st_size);
+		return;
+	}
+	if (st.magic != STATEMAGIC || st.size != (unsigned long)sb.st_size
+	|| st.nmons > st.size || st.nclients > st.size
+	|| st.nswallows > st.size || st.nstack > st.size || st.nmisses > st.size
+	|| st.size != sizeof st + st.nmons * sizeof(MonState)
+	   + st.nclients * sizeof(ClientState) + st.nswallows * sizeof(SwallowState)
+	   + st.nstack * sizeof(Window) + st.nmisses * sizeof(long)) {
+		fputs("warning: ignoring malformed state of previous instance\n", stderr);
+		munmap(buf, sb.st_size);
+		return;
+	}
+	ms = (MonState *)(buf + sizeof st);
+	cs = (ClientState *)(ms + st.nmons);
+	ss = (SwallowState *)(cs + st.nclients);
+	stack = (Window *)(ss + st.nswallows);
+	if (persistfontmisses && st.fontsid == fontsid())
+		drw_fontset_setmisses(drw, (long *)(stack + st.nstack), st.nmisses);
+
+	for (i = 0; i < st.nmons; i++) {
+		for (m = mons; m && m->num != ms[i].num; m = m->next);
+		if (!m)
+			continue;
+		if (ms[i].mfact >= 0.05 && ms[i].mfact <= 0.95)
+			m->mfact = ms[i].mfact;
+		m->nmaster = MAX(ms[i].nmaster, 0);
+		m->gappx = MAX(ms[i].gappx, 0);
+		m->seltags = ms[i].seltags & 1;
+		m->sellt = ms[i].sellt & 1;
+		for (j = 0; j < 2; j++) {
+			if (ms[i].tagset[j] & TAGMASK)
+				m->tagset[j] = ms[i].tagset[j] & TAGMASK;
+			if (ms[i].lt[j] >= 0 && ms[i].lt[j] < (int)LENGTH(layouts))
+				m->lt[j] = &layouts[ms[i].lt[j]];
+		}
+		strncpy(m->ltsymbol, m->lt[m->sellt]->symbol, sizeof m->ltsymbol - 1);
+		if (m->showbar != !!ms[i].showbar) {
+			m->showbar = !!ms[i].showbar;
+			updatebarpos(m);
+			XMoveResizeWindow(dpy, m->barwin, m->wx, m->by, m->ww, bh);
+		}
+		if (m->num == (int)st.selmon)
+			selmon = m;
+	}
+
+	/* Check which windows still exist, all at once. */
+	cl = ecalloc(st.nclients, sizeof(Client *));
+	ck = ecalloc(st.nclients, sizeof(*ck));
+	for (i = 0; i < st.nclients; i++)
+		ck[i] = xcb_get_window_attributes(xcon, cs[i].win);
+	for (i = 0; i < st.nclients; i++) {
+		if (!(r = xcb_get_window_attributes_reply(xcon, ck[i], NULL)))
+			continue;
+		free(r);
+		c = cl[i] = ecalloc(1, sizeof(Client));
+		memcpy(c->name, cs[i].name, sizeof c->name);
+		c->name[sizeof c->name - 1] = '\0';
+		c->mina = cs[i].mina; c->maxa = cs[i].maxa; c->cfact = cs[i].cfact;
+		c->x = cs[i].x; c->y = cs[i].y; c->w = cs[i].w; c->h = cs[i].h;
+		c->oldx = cs[i].oldx; c->oldy = cs[i].oldy;
+		c->oldw = cs[i].oldw; c->oldh = cs[i].oldh;
+		c->basew = cs[i].basew; c->baseh = cs[i].baseh;
+		c->incw = cs[i].incw; c->inch = cs[i].inch;
+		c->maxw = cs[i].maxw; c->maxh = cs[i].maxh;
+		c->minw = cs[i].minw; c->minh = cs[i].minh;
+		c->bw = cs[i].bw; c->oldbw = cs[i].oldbw;
+		c->isfixed = cs[i].isfixed; c->isfloating = cs[i].isfloating;
+		c->isurgent = cs[i].isurgent; c->neverfocus = cs[i].neverfocus;
+		c->oldstate = cs[i].oldstate;
+		c->iscovertfullscreen = cs[i].iscovertfullscreen;
+		c->isfakefullscreen = cs[i].isfakefullscreen;
+		c->isprotected = cs[i].isprotected;
+		c->win = cs[i].win;
+		for (m = mons; m && m->num != cs[i].mon; m = m->next);
+		c->mon = m ? m : selmon;
+		if (!(c->tags = cs[i].tags & TAGMASK))
+			c->tags = c->mon->tagset[c->mon->seltags];
+		XSelectInput(dpy, c->win, EnterWindowMask|FocusChangeMask|PropertyChangeMask|StructureNotifyMask);
+		grabbuttons(c, 0);
+		XSetWindowBorder(dpy, c->win, scheme[SchemeNorm][ColBorder].pixel);
+	}
+	free(ck);
+
+	/* Relink the swallow chains and attach their heads to the client
+	 * lists. A swallower succeeding a vanished head is mapped as swalstop()
+	 * would. The heads are remembered in 'cl' at the chains' first index. */
+	for (i = 0; i < st.nclients; i = j) {
+		for (j = i + 1; j < st.nclients && !cs[j].head; j++);
+		for (head = prev = NULL, k = i; k < j; k++) {
+			if (!(c = cl[k]))
+				continue;
+			if (prev)
+				prev->swallowedby = c;
+			else
+				head = c;
+			prev = c;
+		}
+		if (!head)
+			continue;
+		if (head != cl[i]) {
+			for (m = mons; m && m->num != cs[i].mon; m = m->next);
+			head->mon = m ? m : selmon;
+			if (!(head->tags = cs[i].tags & TAGMASK))
+				head->tags = head->mon->tagset[head->mon->seltags];
+			head->isfloating = cs[i].isfloating;
+			setclientstate(head, NormalState);
+			XMapWindow(dpy, head->win);
+			cl[i] = head;
+		}
+		attachbottom(head);
+		winchain(head);
+	}
+
+	/* Rebuild the focus stacks bottom up. Heads missing from the stored
+	 * stacks end up at the bottom. */
+	for (k = st.nstack + 1; k-- > 0;)
+		for (i = 0; i < st.nclients; i++) {
+			if (!cs[i].head || !cl[i] || (k < st.nstack && cs[i].win != stack[k]))
+				continue;
+			for (c = cl[i]->mon->stack; c && c != cl[i]; c = c->snext);
+			if (!c)
+				attachstack(cl[i]);
+		}
+
+	for (i = 0; i < st.nmons; i++) {
+		for (m = mons; m && m->num != ms[i].num; m = m->next);
+		if (!m)
+			continue;
+		for (c = m->stack; c && c->win != ms[i].sel; c = c->snext);
+		m->sel = c ? c : m->stack;
+	}
+
+	/* Restore the swallow pool in order. */
+	for (ps = &swallows; *ps; ps = &(*ps)->next);
+	for (i = 0; i < st.nswallows; i++) {
+		for (k = 0; k < st.nclients && (!cl[k] || cl[k]->win != ss[i].client); k++);
+		if (k == st.nclients)
+			continue;
+		s = ecalloc(1, sizeof(Swallow));
+		memcpy(s->class, ss[i].class, sizeof s->class - 1);
+		memcpy(s->inst, ss[i].inst, sizeof s->inst - 1);
+		memcpy(s->title, ss[i].title, sizeof s->title - 1);
+		s->decay = ss[i].decay;
+		s->client = cl[k];
+		*ps = s;
+		ps = &s->next;
+	}
+	swaldirty = 1;
+
+	free(cl);
+	munmap(buf, sb.st_size);
+	selmon->dirty |= DirtyClientList;
+	arrange(NULL);
+	focus(NULL);
+}
+
 /*
  * Decrease decay counter of all swallows in the pool by 'decayby' and remove
  * any swallow instances whose counter is less than or equal to zero.
@@ -1423,6 +2160,7 @@ swalreg(Client *c, const char *class, const char *inst, const char *title)
 			else
 				s->title[0] = '\0';
 			s->decay = swaldecay;
+			swaldirty = 1;
 
 			/* Only one swallow per client. May return after first hit. */
 			return;
@@ -1441,14 +2179,34 @@ swalreg(Client *c, const char *class, const char *inst, const char *title)
 
 	s->next = swallows;
 	swallows = s;
+	swaldirty = 1;
 }
 
+/*
+ * Manage window 'w'. 'p' shall hold the replies to propsrequest() for 'w', or
+ * be NULL in which case the properties are fetched. The replies are freed.
+ */
 void
-manage(Window w, XWindowAttributes *wa)
+manage(Window w, XWindowAttributes *wa, Props *p)
 {
 	Client *c, *t = NULL;
 	Window trans = None;
+	Atom state, wtype;
+	uint32_t *v;
 	XWindowChanges wc;
+	XSizeHints size;
+	XWMHints wmh;
+	Props props;
+	char class[256], instance[256];
+
+	/* Request all properties evaluated below at once, such that managing a
+	 * window costs a single round trip. */
+	if (!p) {
+		p = &props;
+		propsrequest(p, w);
+		propsreply(p);
+	}
+	propclass(p, class, instance, sizeof class);
 
 	c = ecalloc(1, sizeof(Client));
 	c->win = w;
@@ -1460,15 +2218,17 @@ manage(Window w, XWindowAttributes *wa)
 	c->oldbw = wa->border_width;
 	c->cfact = 1.0;
 
-	updatetitle(c); /* sets c->name */
-	if (XGetTransientForHint(dpy, w, &trans) && (t = wintoclient(trans))) {
+	settitle(c, class); /* sets c->name */
+	if ((v = propvalue(p, PropWMTransientFor, XA_WINDOW, 32, 1)))
+		trans = v[0];
+	if (trans != None && (t = wintoclient(trans))) {
 		/* If 'w' is a transient window (e.g. pop-up, dialogue box, ..) on behalf of an existing
 		 * top-level window 'trans' map it to the same tags and monitors. See ICCCM 4.1.2.6. */
 		c->mon = t->mon;
 		c->tags = t->tags;
 	} else {
 		c->mon = selmon;
-		applyrules(c);
+		applyrules(c, class, instance);
 	}
 
 	/*
@@ -1494,17 +2254,23 @@ manage(Window w, XWindowAttributes *wa)
 	XSetWindowBorder(dpy, w, scheme[SchemeNorm][ColBorder].pixel);
 
 	configure(c); /* propagates border_width, if size doesn't change */
-	updatewindowtype(c); /* fullscreen || floating */
-	updatesizehints(c); /* initialize size hint fields */
-	updatewmhints(c);
+	state = (v = propvalue(p, PropNetWMState, XA_ATOM, 32, 1)) ? v[0] : None;
+	wtype = (v = propvalue(p, PropNetWMWindowType, XA_ATOM, 32, 1)) ? v[0] : None;
+	setwindowtype(c, state, wtype); /* fullscreen || floating */
+	propsizehints(p, &size);
+	setsizehints(c, &size); /* initialize size hint fields */
+	if (propwmhints(p, &wmh))
+		setwmhints(c, &wmh);
+	propsfree(p);
 	XSelectInput(dpy, w, EnterWindowMask|FocusChangeMask|PropertyChangeMask|StructureNotifyMask);
 	grabbuttons(c, 0);
 	if (!c->isfloating)
 		c->isfloating = c->oldstate = trans != None || c->isfixed;
 	if (c->isfloating)
-		XRaiseWindow(dpy, c->win);
+		raiseclient(c);
 	attachbottom(c);
 	attachstack(c);
+	winadd(c, NULL);
 	XChangeProperty(dpy, root, netatom[NetClientList], XA_WINDOW, 32, PropModeAppend,
 		(unsigned char *) &(c->win), 1);
 	XMoveResizeWindow(dpy, c->win, c->x + 2 * sw, c->y, c->w, c->h); /* some windows require this */
@@ -1523,6 +2289,39 @@ manage(Window w, XWindowAttributes *wa)
 	focus(NULL);
 }
 
+/*
+ * Rebuild the index of the swallow pool used by swalmatch(): a matcher over
+ * the class and instance filters each, the ids being the swallows' positions
+ * in the pool.
+ */
+void
+swalindex(void)
+{
+	Swallow *s;
+	size_t i;
+
+	matcher_free(swalmatcher[0]);
+	matcher_free(swalmatcher[1]);
+	free(swalvec);
+	free(swalbits[0]);
+	free(swalbits[1]);
+	for (nswalvec = 0, s = swallows; s; s = s->next)
+		nswalvec++;
+	swalvec = ecalloc(nswalvec + 1, sizeof(Swallow *));
+	swalbits[0] = ecalloc(nswalvec / LONGBITS + 1, sizeof(unsigned long));
+	swalbits[1] = ecalloc(nswalvec / LONGBITS + 1, sizeof(unsigned long));
+	swalmatcher[0] = matcher_create();
+	swalmatcher[1] = matcher_create();
+	for (i = 0, s = swallows; s; s = s->next, i++) {
+		swalvec[i] = s;
+		matcher_add(swalmatcher[0], s->class, i);
+		matcher_add(swalmatcher[1], s->inst, i);
+	}
+	matcher_compile(swalmatcher[0]);
+	matcher_compile(swalmatcher[1]);
+	swaldirty = 0;
+}
+
 /*
  * Window configuration and client setup for new windows which are to be
  * swallowed immediately. Pendant to manage() for such windows.
@@ -1547,6 +2346,7 @@ swalmanage(Swallow *s, Window w, XWindowAttributes *wa)
 	swee->bw = borderpx;
 	attach(swee);
 	attachstack(swee);
+	winadd(swee, NULL);
 	updatetitle(swee);
 	updatesizehints(swee);
 	XSelectInput(dpy, swee->win, EnterWindowMask|FocusChangeMask|PropertyChangeMask|StructureNotifyMask);
@@ -1569,7 +2369,7 @@ mappingnotify(XEvent *e)
 	XMappingEvent *ev = &e->xmapping;
 
 	XRefreshKeyboardMapping(ev);
-	if (ev->request == MappingKeyboard)
+	if (ev->request == MappingKeyboard || ev->request == MappingModifier)
 		grabkeys();
 }
 
@@ -1604,7 +2404,7 @@ maprequest(XEvent *e)
 		if (s = swalmatch(ev->window))
 			swalmanage(s, ev->window, &wa);
 		else
-			manage(ev->window, &wa);
+			manage(ev->window, &wa, NULL);
 		break;
 	}
 
@@ -1613,16 +2413,23 @@ maprequest(XEvent *e)
 		swaldecayby(1);
 }
 
+/* Set bit 'id' of the bit set 'bits'. Callback of matcher_match(). */
+void
+matchbit(unsigned int id, void *bits)
+{
+	((unsigned long *)bits)[id / LONGBITS] |= 1UL << id % LONGBITS;
+}
+
 /*
  * Apply monocle layout
  */
 void
-monocle(Monitor *m)
+monocle(Monitor *m, Geom *g)
 {
 	Client *c;
 
-	for (c = nexttiled(m->clients); c; c = nexttiled(c->next))
-		resize(c, m->wx, m->wy, m->ww - 2 * c->bw, m->wh - 2 * c->bw, 0);
+	for (c = nexttiled(m->clients); c; c = nexttiled(c->next), g++)
+		setgeom(g, c, m->wx, m->wy, m->ww - 2 * c->bw, m->wh - 2 * c->bw);
 }
 
 void
@@ -1694,6 +2501,7 @@ movemouse(const Arg *arg)
 				resize(c, nx, ny, c->w, c->h, 1);
 			break;
 		}
+		commit(); /* nested event loop; see run() */
 	} while (ev.type != ButtonRelease);
 	XUngrabPointer(dpy, CurrentTime);
 	if ((m = recttomon(c->x, c->y, c->w, c->h)) != selmon) {
@@ -1771,6 +2579,29 @@ pop(Client *c)
 	arrange(c->mon);
 }
 
+/*
+ * Write instance and class name from WM_CLASS to 'instance' and 'class'
+ * (limited to 'size' chars). Clients which don't define them are labeled as
+ * broken.
+ */
+void
+propclass(Props *p, char *class, char *instance, size_t size)
+{
+	const char *v;
+	int len, n;
+
+	strcpy(class, broken);
+	strcpy(instance, broken);
+	if (!(v = propvalue(p, PropWMClass, XA_STRING, 8, 1)))
+		return;
+	len = xcb_get_property_value_length(p->reply[PropWMClass]);
+	/* The value consists of two consecutive null-terminated strings. */
+	if ((n = strnlen(v, len)) > 0)
+		snprintf(instance, size, "%.*s", n, v);
+	if (n + 1 < len && (len = strnlen(v + n + 1, len - n - 1)) > 0)
+		snprintf(class, size, "%.*s", len, v + n + 1);
+}
+
 void
 propertynotify(XEvent *e)
 {
@@ -1822,6 +2653,144 @@ propertynotify(XEvent *e)
 	}
 }
 
+void
+propsfree(Props *p)
+{
+	int i;
+
+	for (i = 0; i < PropLast; i++)
+		free(p->reply[i]);
+}
+
+/*
+ * Decode WM_NORMAL_HINTS like XGetWMNormalHints(). If the property is not set
+ * only PSize is flagged.
+ */
+void
+propsizehints(Props *p, XSizeHints *size)
+{
+	int32_t *v;
+
+	size->flags = PSize;
+	/* Pre-ICCCM clients set only the first 15 fields. */
+	if (!(v = propvalue(p, PropWMNormalHints, XA_WM_SIZE_HINTS, 32, 15)))
+		return;
+	size->flags = v[0];
+	size->x = v[1];
+	size->y = v[2];
+	size->width = v[3];
+	size->height = v[4];
+	size->min_width = v[5];
+	size->min_height = v[6];
+	size->max_width = v[7];
+	size->max_height = v[8];
+	size->width_inc = v[9];
+	size->height_inc = v[10];
+	size->min_aspect.x = v[11];
+	size->min_aspect.y = v[12];
+	size->max_aspect.x = v[13];
+	size->max_aspect.y = v[14];
+	if (propvalue(p, PropWMNormalHints, XA_WM_SIZE_HINTS, 32, 18)) {
+		size->base_width = v[15];
+		size->base_height = v[16];
+		size->win_gravity = v[17];
+	} else {
+		size->flags &= ~(PBaseSize|PWinGravity);
+	}
+}
+
+/*
+ * Collect the replies to the requests sent by propsrequest(). Missing
+ * properties and errors (e.g. due to the window being destroyed meanwhile)
+ * result in a NULL reply.
+ */
+void
+propsreply(Props *p)
+{
+	xcb_generic_error_t *err;
+	int i;
+
+	for (i = 0; i < PropLast; i++) {
+		err = NULL;
+		p->reply[i] = xcb_get_property_reply(xcon, p->cookie[i], &err);
+		free(err);
+	}
+}
+
+/*
+ * Send requests for all properties of window 'w' evaluated when managing it
+ * without waiting for the replies.
+ */
+void
+propsrequest(Props *p, Window w)
+{
+	static const struct { int prop; Atom type; uint32_t len; } reqs[] = {
+		/* length in 32-bit units */
+		{ PropWMClass,         XA_STRING,        256 },
+		{ PropWMTransientFor,  XA_WINDOW,          1 },
+		{ PropWMNormalHints,   XA_WM_SIZE_HINTS,  18 },
+		{ PropWMHints,         XA_WM_HINTS,        9 },
+		{ PropNetWMState,      XA_ATOM,            1 },
+		{ PropNetWMWindowType, XA_ATOM,            1 },
+	};
+	Atom atoms[PropLast] = {
+		[PropWMClass]         = XA_WM_CLASS,
+		[PropWMTransientFor]  = XA_WM_TRANSIENT_FOR,
+		[PropWMNormalHints]   = XA_WM_NORMAL_HINTS,
+		[PropWMHints]         = XA_WM_HINTS,
+		[PropNetWMState]      = netatom[NetWMState],
+		[PropNetWMWindowType] = netatom[NetWMWindowType],
+	};
+	int i;
+
+	for (i = 0; i < LENGTH(reqs); i++)
+		p->cookie[reqs[i].prop] = xcb_get_property(xcon, 0, w,
+			atoms[reqs[i].prop], reqs[i].type, 0, reqs[i].len);
+}
+
+/*
+ * Return the value of property 'prop' if it's of type 'type' and format
+ * 'format' and holds at least 'nitems' items. Returns NULL otherwise.
+ */
+void *
+propvalue(Props *p, int prop, Atom type, int format, int nitems)
+{
+	xcb_get_property_reply_t *r = p->reply[prop];
+
+	if (!r || r->type != type || r->format != format
+	|| xcb_get_property_value_length(r) < nitems * (format / 8))
+		return NULL;
+	return xcb_get_property_value(r);
+}
+
+/*
+ * Decode WM_HINTS like XGetWMHints(). Returns 0 if the property is not set.
+ */
+int
+propwmhints(Props *p, XWMHints *wmh)
+{
+	int32_t *v;
+
+	/* Pre-ICCCM clients don't set the window group. */
+	if (!(v = propvalue(p, PropWMHints, XA_WM_HINTS, 32, 8)))
+		return 0;
+	wmh->flags = v[0];
+	wmh->input = v[1];
+	wmh->initial_state = v[2];
+	wmh->icon_pixmap = v[3];
+	wmh->icon_window = v[4];
+	wmh->icon_x = v[5];
+	wmh->icon_y = v[6];
+	wmh->icon_mask = v[7];
+	if (propvalue(p, PropWMHints, XA_WM_HINTS, 32, 9))
+		wmh->window_group = v[8];
+	else {
+		wmh->window_group = 0;
+		wmh->flags &= ~WindowGroupHint;
+	}
+	return 1;
+}
+
 void
 quit(const Arg *arg)
 {
@@ -1829,6 +2798,18 @@ quit(const Arg *arg)
 	running = 0;
 }
 
+/*
+ * Raise the window of 'c'. A tiled window thereby loses its place in the
+ * stacking order applied by restackmon(), which is invalidated.
+ */
+void
+raiseclient(Client *c)
+{
+	XRaiseWindow(dpy, c->win);
+	if (!c->isfloating)
+		c->mon->norder = 0;
+}
+
 Monitor *
 recttomon(int x, int y, int w, int h)
 {
@@ -1868,6 +2849,7 @@ swalmouse(const Arg *arg)
 			handler[ev.type](&ev);
 			break;
 		}
+		commit(); /* nested event loop; see run() */
 	} while (ev.type != ButtonRelease);
 	XUngrabPointer(dpy, CurrentTime);
 
@@ -1875,9 +2857,8 @@ swalmouse(const Arg *arg)
 		&& swer != swee)
 		swal(swer, swee, 0);
 
-	/* Remove accumulated pending EnterWindow events caused by the mouse
-	 * movements. */
-	XCheckMaskEvent(dpy, EnterWindowMask, &ev);
+	/* Ignore crossings caused by the mouse movements. */
+	ignorecrossings();
 }
 
 /*
@@ -1902,6 +2883,7 @@ swalrm(Swallow *s)
 		}
 		swallows = NULL;
 	}
+	swaldirty = 1;
 }
 
 /*
@@ -1929,7 +2911,8 @@ resize(Client *c, int x, int y, int w, int h, int interact)
 }
 
 /*
- * Resize a client window (with immediate effect)
+ * Resize a client window. The requests are not flushed, such that the resizes
+ * of an arrange are pipelined and sent by commit() at once.
  */
 void
 resizeclient(Client *c, int x, int y, int w, int h)
@@ -1942,8 +2925,10 @@ resizeclient(Client *c, int x, int y, int w, int h)
 	c->oldh = c->h; c->h = wc.height = h;
 	wc.border_width = c->bw;
 	XConfigureWindow(dpy, c->win, CWX|CWY|CWWidth|CWHeight|CWBorderWidth, &wc);
-	configure(c);
-	XSync(dpy, False);
+	/* ICCCM 4.1.5: The real ConfigureNotify of a resize suffices, but a
+	 * window which is merely moved is told its new position by us. */
+	if (c->w == c->oldw && c->h == c->oldh)
+		configure(c);
 }
 
 void
@@ -1992,10 +2977,11 @@ resizemouse(const Arg *arg)
 				resize(c, c->x, c->y, nw, nh, 1);
 			break;
 		}
+		commit(); /* nested event loop; see run() */
 	} while (ev.type != ButtonRelease);
 	XWarpPointer(dpy, None, c->win, 0, 0, 0, 0, c->w + c->bw - 1, c->h + c->bw - 1);
 	XUngrabPointer(dpy, CurrentTime);
-	while (XCheckMaskEvent(dpy, EnterWindowMask, &ev)); /* Remove accumulated pending EnterWindow events */
+	ignorecrossings(); /* crossings caused by the resize */
 	if ((m = recttomon(c->x, c->y, c->w, c->h)) != selmon) {
 		sendmon(c, m);
 		selmon = m;
@@ -2003,77 +2989,347 @@ resizemouse(const Arg *arg)
 	}
 }
 
+/*
+ * Schedule restacking monitor 'm' and redrawing its bar. See commit().
+ */
+void
+restack(Monitor *m)
+{
+	m->dirty |= DirtyStack|DirtyBar;
+}
+
 /*
  * Apply stacking order as represented by the stack list to all tiled windows,
  * starting with the bar.
  */
 void
-restack(Monitor *m)
+restackmon(Monitor *m)
 {
 	// ???: When does is become necessary to restack?
 	Client *c;
-	XEvent ev;
-	XWindowChanges wc;
+	unsigned long req = NextRequest(dpy);
+	unsigned int n;
 
-	drawbar(m);
 	if (!m->sel)
 		return;
 
 	/* If selected window is floating raise it to the top. */
 	if (m->sel->isfloating || !m->lt[m->sellt]->arrange)
-		XRaiseWindow(dpy, m->sel->win);
+		raiseclient(m->sel);
 
+	/* Stack the visible tiled clients below the bar in focus order, unless
+	 * they are already. */
 	if (m->lt[m->sellt]->arrange) {
-		wc.stack_mode = Below;
-		wc.sibling = m->barwin;
-		for (c = m->stack; c; c = c->snext) {
-			if (!c->isfloating && ISVISIBLE(c)) {
-				XConfigureWindow(dpy, c->win, CWSibling|CWStackMode, &wc);
-				wc.sibling = c->win;
-			}
+		for (n = 1, c = m->stack; c; c = c->snext)
+			n += !c->isfloating && ISVISIBLE(c);
+		if (n > nstackbuf) {
+			free(stackbuf);
+			stackbuf = ecalloc(n, sizeof(Window));
+			nstackbuf = n;
+		}
+		stackbuf[0] = m->barwin;
+		for (n = 1, c = m->stack; c; c = c->snext)
+			if (!c->isfloating && ISVISIBLE(c))
+				stackbuf[n++] = c->win;
+		if (n != m->norder || memcmp(stackbuf, m->order, n * sizeof(Window))) {
+			XRestackWindows(dpy, stackbuf, n);
+			free(m->order);
+			m->order = ecalloc(n, sizeof(Window));
+			memcpy(m->order, stackbuf, n * sizeof(Window));
+			m->norder = n;
 		}
 	}
-	XSync(dpy, False);
 
-	while (XCheckMaskEvent(dpy, EnterWindowMask, &ev));
+	/* The pointer may now be in another window, but it has not been
+	 * moved by the user. */
+	if (NextRequest(dpy) != req)
+		ignorecrossings();
+}
+
+/*
+ * Return the set of rules whose class and instance patterns match 'class' and
+ * 'instance'. Results are cached, as windows of the same application tend to
+ * be mapped over and over.
+ */
+const unsigned long *
+rulecandidates(const char *class, const char *instance)
+{
+	unsigned long cls[RULEWORDS + 1], inst[RULEWORDS + 1];
+	size_t lc = strlen(class), li = strlen(instance), i;
+	unsigned int h = 2166136261u;
+	RuleCache *e;
+
+	for (i = 0; i < lc + 1 + li; i++) /* FNV-1a over "class\0instance" */
+		h = (h ^ (unsigned char)(i <= lc ? class[i] : instance[i - lc - 1])) * 16777619u;
+	e = &rulecache[h % LENGTH(rulecache)];
+	if (e->key && e->len == lc + 1 + li && !memcmp(e->key, class, lc + 1)
+	&& !memcmp(e->key + lc + 1, instance, li))
+		return e->rules;
+
+	free(e->key);
+	e->key = ecalloc(lc + 1 + li + 1, 1);
+	memcpy(e->key, class, lc + 1);
+	memcpy(e->key + lc + 1, instance, li + 1);
+	e->len = lc + 1 + li;
+	if (!e->rules)
+		e->rules = ecalloc(RULEWORDS + 1, sizeof(unsigned long));
+	rulematch(RuleClass, class, NULL, cls);
+	rulematch(RuleInstance, instance, NULL, inst);
+	for (i = 0; i < RULEWORDS; i++)
+		e->rules[i] = cls[i] & inst[i];
+	return e->rules;
+}
+
+/*
+ * Write the set of rules whose pattern for field 'f' matches 'text' into
+ * 'bits'. Regular expressions are only evaluated for rules in 'only', if
+ * given; the result is undefined for other rules.
+ */
+void
+rulematch(int f, const char *text, const unsigned long *only, unsigned long *bits)
+{
+	char buf[256 + 3];
+	unsigned int i, r;
+
+	memcpy(bits, ruleany[f], RULEWORDS * sizeof(unsigned long));
+	snprintf(buf, sizeof buf, RULEBOL "%s" RULEEOL, text);
+	matcher_match(rulematcher[f], buf, matchbit, bits);
+	for (i = 0; i < nruleregex[f]; i++) {
+		r = ruleregexidx[f][i];
+		if ((!only || only[r / LONGBITS] >> r % LONGBITS & 1)
+		&& !regexec(&ruleregex[f][i], text, 0, NULL, 0))
+			bits[r / LONGBITS] |= 1UL << r % LONGBITS;
+	}
 }
 
+/*
+ * Main loop. Multiplexes the X connection, the signalfd and any other
+ * registered sources via epoll and drains every ready source per wakeup.
+ */
 void
 run(void)
 {
-	XEvent ev;
-	/* main event loop */
-	XSync(dpy, False);
-	while (running && !XNextEvent(dpy, &ev))
-		if (handler[ev.type])
-			handler[ev.type](&ev); /* call handler */
+	struct epoll_event evs[8];
+	int i, n;
+
+	commit(); /* work scheduled by setup() and scan() */
+	xsync();
+	while (running) {
+		/* Xlib may have queued events while waiting for replies, in which
+		 * case the connection does not become readable. Drain the queue
+		 * (which also flushes the output buffer) before going to sleep. */
+		xevents();
+		if (!running)
+			break;
+		if ((n = epoll_wait(epfd, evs, LENGTH(evs), -1)) < 0) {
+			if (errno == EINTR)
+				continue;
+			die("epoll_wait:");
+		}
+		for (i = 0; i < n; i++)
+			((Source *)evs[i].data.ptr)->func();
+		commit();
+	}
+}
+
+/*
+ * Hand the state of all monitors, clients and swallows over to the process
+ * exec'd by a restart such that it need not rediscover it from the X server,
+ * see loadstate(). The state is passed as a sealed memfd inherited across
+ * exec whose number is stored in the environment. On failure the new
+ * process falls back to scan().
+ */
+void
+savestate(void)
+{
+	State st = {
+		.magic = STATEMAGIC, .layout = STATEVERSION, .monsize = sizeof(MonState),
+		.clientsize = sizeof(ClientState), .swallowsize = sizeof(SwallowState),
+	};
+	MonState *ms;
+	ClientState *cs;
+	SwallowState *ss;
+	Window *stack;
+	Monitor *m;
+	Client *c, *d;
+	Swallow *s;
+	char *buf, fdstr[16];
+	int fd, i;
+
+	for (m = mons; m; m = m->next) {
+		st.nmons++;
+		for (c = m->clients; c; c = c->next)
+			for (d = c; d; d = d->swallowedby)
+				st.nclients++;
+		for (c = m->stack; c; c = c->snext)
+			st.nstack++;
+	}
+	for (s = swallows; s; s = s->next)
+		st.nswallows++;
+	if (persistfontmisses)
+		st.nmisses = drw_fontset_getmisses(drw, NULL, 0);
+	strncpy(st.version, VERSION, sizeof st.version - 1);
+	st.selmon = selmon->num;
+	st.fontsid = fontsid();
+	st.size = sizeof st + st.nmons * sizeof(MonState)
+		+ st.nclients * sizeof(ClientState) + st.nswallows * sizeof(SwallowState)
+		+ st.nstack * sizeof(Window) + st.nmisses * sizeof(long);
+	buf = ecalloc(1, st.size);
+	memcpy(buf, &st, sizeof st);
+	ms = (MonState *)(buf + sizeof st);
+	cs = (ClientState *)(ms + st.nmons);
+	ss = (SwallowState *)(cs + st.nclients);
+	stack = (Window *)(ss + st.nswallows);
+
+	for (m = mons; m; m = m->next, ms++) {
+		ms->mfact = m->mfact;
+		ms->num = m->num;
+		ms->nmaster = m->nmaster;
+		ms->gappx = m->gappx;
+		ms->showbar = m->showbar;
+		ms->seltags = m->seltags;
+		ms->sellt = m->sellt;
+		ms->tagset[0] = m->tagset[0];
+		ms->tagset[1] = m->tagset[1];
+		for (i = 0; i < 2; i++)
+			for (ms->lt[i] = LENGTH(layouts) - 1; ms->lt[i] > 0 && m->lt[i] != &layouts[ms->lt[i]]; ms->lt[i]--);
+		ms->sel = m->sel ? m->sel->win : None;
+		for (c = m->clients; c; c = c->next)
+			for (d = c; d; d = d->swallowedby, cs++) {
+				memcpy(cs->name, d->name, sizeof cs->name);
+				cs->mina = d->mina; cs->maxa = d->maxa; cs->cfact = d->cfact;
+				cs->x = d->x; cs->y = d->y; cs->w = d->w; cs->h = d->h;
+				cs->oldx = d->oldx; cs->oldy = d->oldy;
+				cs->oldw = d->oldw; cs->oldh = d->oldh;
+				cs->basew = d->basew; cs->baseh = d->baseh;
+				cs->incw = d->incw; cs->inch = d->inch;
+				cs->maxw = d->maxw; cs->maxh = d->maxh;
+				cs->minw = d->minw; cs->minh = d->minh;
+				cs->bw = d->bw; cs->oldbw = d->oldbw;
+				cs->tags = d->tags;
+				cs->isfixed = d->isfixed; cs->isfloating = d->isfloating;
+				cs->isurgent = d->isurgent; cs->neverfocus = d->neverfocus;
+				cs->oldstate = d->oldstate;
+				cs->iscovertfullscreen = d->iscovertfullscreen;
+				cs->isfakefullscreen = d->isfakefullscreen;
+				cs->isprotected = d->isprotected;
+				cs->mon = m->num;
+				cs->head = d == c;
+				cs->win = d->win;
+			}
+	}
+	for (s = swallows; s; s = s->next, ss++) {
+		memcpy(ss->class, s->class, sizeof ss->class);
+		memcpy(ss->inst, s->inst, sizeof ss->inst);
+		memcpy(ss->title, s->title, sizeof ss->title);
+		ss->decay = s->decay;
+		ss->client = s->client->win;
+	}
+	for (m = mons; m; m = m->next)
+		for (c = m->stack; c; c = c->snext)
+			*stack++ = c->win;
+	drw_fontset_getmisses(drw, (long *)stack, st.nmisses);
+
+	/* Not close-on-exec, so the descriptor survives execvp(). */
+	if ((fd = memfd_create("dwm-state", MFD_ALLOW_SEALING)) < 0
+	|| write(fd, buf, st.size) != (ssize_t)st.size
+	|| fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_WRITE|F_SEAL_SEAL) < 0) {
+		perror("dwm: cannot save state");
+		if (fd >= 0)
+			close(fd);
+	} else {
+		snprintf(fdstr, sizeof fdstr, "%d", fd);
+		setenv(STATEENV, fdstr, 1);
+	}
+	free(buf);
 }
 
 void
 scan(void)
 {
-	unsigned int i, num;
+	struct {
+		xcb_get_window_attributes_cookie_t attr;
+		xcb_get_geometry_cookie_t geom;
+		xcb_get_property_cookie_t trans, state;
+		XWindowAttributes wa;
+		int manage, istrans;
+		Props p;
+	} *ws;
+	xcb_get_window_attributes_reply_t *attr;
+	xcb_get_geometry_reply_t *geom;
+	xcb_get_property_reply_t *trans, *state;
+	xcb_generic_error_t *err;
+	unsigned int i, num, pass;
 	Window d1, d2, *wins = NULL;
-	XWindowAttributes wa;
+	Client *c;
 
-	if (XQueryTree(dpy, root, &d1, &d2, &wins, &num)) {
-		for (i = 0; i < num; i++) {
-			if (!XGetWindowAttributes(dpy, wins[i], &wa)
-				|| wa.override_redirect || XGetTransientForHint(dpy, wins[i], &d1))
-				continue;
-			if (wa.map_state == IsViewable || getstate(wins[i]) == IconicState)
-				manage(wins[i], &wa);
-		}
-		for (i = 0; i < num; i++) { /* now the transients */
-			if (!XGetWindowAttributes(dpy, wins[i], &wa))
-				continue;
-			if (XGetTransientForHint(dpy, wins[i], &d1)
-			&& (wa.map_state == IsViewable || getstate(wins[i]) == IconicState))
-				manage(wins[i], &wa);
+	if (!XQueryTree(dpy, root, &d1, &d2, &wins, &num))
+		return;
+	ws = ecalloc(num, sizeof(*ws));
+
+	/* Query attributes, geometry, transient hint and WM_STATE of all
+	 * windows at once, then collect the replies. */
+	for (i = 0; i < num; i++) {
+		ws[i].attr = xcb_get_window_attributes(xcon, wins[i]);
+		ws[i].geom = xcb_get_geometry(xcon, wins[i]);
+		ws[i].trans = xcb_get_property(xcon, 0, wins[i], XA_WM_TRANSIENT_FOR,
+			XA_WINDOW, 0, 1);
+		ws[i].state = xcb_get_property(xcon, 0, wins[i], wmatom[WMState],
+			wmatom[WMState], 0, 2);
+	}
+	for (i = 0; i < num; i++) {
+		/* Windows may have been destroyed meanwhile. Collect the errors
+		 * here rather than have them reach xerror(). */
+		attr = xcb_get_window_attributes_reply(xcon, ws[i].attr, &err);
+		free(err);
+		geom = xcb_get_geometry_reply(xcon, ws[i].geom, &err);
+		free(err);
+		trans = xcb_get_property_reply(xcon, ws[i].trans, &err);
+		free(err);
+		state = xcb_get_property_reply(xcon, ws[i].state, &err);
+		free(err);
+		if (attr && geom && !attr->override_redirect) {
+			ws[i].wa.x = geom->x;
+			ws[i].wa.y = geom->y;
+			ws[i].wa.width = geom->width;
+			ws[i].wa.height = geom->height;
+			ws[i].wa.border_width = geom->border_width;
+			ws[i].wa.map_state = attr->map_state;
+			ws[i].istrans = trans && trans->type == XA_WINDOW
+				&& xcb_get_property_value_length(trans) >= 4;
+			ws[i].manage = attr->map_state == IsViewable
+				|| (state && state->type == wmatom[WMState] && state->format == 32
+				&& xcb_get_property_value_length(state) >= 4
+				&& *(uint32_t *)xcb_get_property_value(state) == IconicState);
 		}
-		if (wins)
-			XFree(wins);
+		free(attr);
+		free(geom);
+		free(trans);
+		free(state);
 	}
+
+	/* Request the properties of all windows to be managed at once. Windows
+	 * adopted by loadstate() are managed already. */
+	for (i = 0; i < num; i++)
+		if (ws[i].manage && wintoclient2(wins[i], &c, NULL))
+			ws[i].manage = 0;
+	for (i = 0; i < num; i++)
+		if (ws[i].manage)
+			propsrequest(&ws[i].p, wins[i]);
+	for (i = 0; i < num; i++)
+		if (ws[i].manage)
+			propsreply(&ws[i].p);
+
+	/* Manage transients after the windows they are transient for. The
+	 * arrange is carried out once per monitor by the next commit(). */
+	for (pass = 0; pass < 2; pass++)
+		for (i = 0; i < num; i++)
+			if (ws[i].manage && ws[i].istrans == pass)
+				manage(wins[i], &ws[i].wa, &ws[i].p);
+
+	free(ws);
+	if (wins)
+		XFree(wins);
 }
 
 /*
@@ -2148,6 +3404,21 @@ setfocus(Client *c)
 	sendevent(c, wmatom[WMTakeFocus]);
 }
 
+/*
+ * Set 'g' to the geometry of client 'c' placed at 'x', 'y' with size 'w' x
+ * 'h', subject to the client's size hints. For use by layouts.
+ */
+void
+setgeom(Geom *g, Client *c, int x, int y, int w, int h)
+{
+	applysizehints(c, &x, &y, &w, &h, 0);
+	g->c = c;
+	g->x = x;
+	g->y = y;
+	g->w = w;
+	g->h = h;
+}
+
 /*
  * Sends a client message pretending to fullscreen a window, but no resize is
  * performed. Take that, Youtube.
@@ -2189,7 +3460,7 @@ covertfullscreen(Client *c, int action)
 			c->bw = 0;
 			c->isfloating = 1;
 			resizeclient(c, c->mon->mx, c->mon->my, c->mon->mw, c->mon->mh);
-			XRaiseWindow(dpy, c->win);
+			raiseclient(c);
 		}
 	}
 	else if (action == ActionUnset) {
@@ -2278,20 +3549,43 @@ setup(void)
 	int i;
 	XSetWindowAttributes wa;
 	Atom utf8string;
+	sigset_t sm;
+
+	/* Block signals handled by dwm and receive them through a signalfd
+	 * instead of asynchronous handlers. SIGCHLD's disposition is reset as
+	 * SIG_IGN (which may be inherited) discards the signal. */
+	signal(SIGCHLD, SIG_DFL);
+	sigemptyset(&sm);
+	sigaddset(&sm, SIGCHLD);
+	sigaddset(&sm, SIGHUP);
+	sigaddset(&sm, SIGTERM);
+	if (sigprocmask(SIG_BLOCK, &sm, NULL) < 0)
+		die("sigprocmask:");
+	if ((sigsrc.fd = signalfd(-1, &sm, SFD_NONBLOCK|SFD_CLOEXEC)) < 0)
+		die("signalfd:");
 
 	/* clean up any zombies immediately */
-	sigchld(0);
+	sigchld();
+
+	/* init main loop sources */
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		die("epoll_create1:");
+	xsrc.fd = ConnectionNumber(dpy);
+	addsource(&xsrc);
+	addsource(&sigsrc);
 
-	signal(SIGHUP, sighup);
-	signal(SIGTERM, sigterm);
+	compilerules();
 
 	/* init screen */
 	screen = DefaultScreen(dpy);
 	sw = DisplayWidth(dpy, screen);
 	sh = DisplayHeight(dpy, screen);
 	root = RootWindow(dpy, screen);
+	xcon = XGetXCBConnection(dpy);
 	xinitvisual();
-	drw = drw_create(dpy, screen, root, sw, sh, visual, depth, cmap);
+	drw = drw_create(dpy, screen, root, 1, 1, visual, depth, cmap); /* bars have buffers of their own */
+	if (clientrender && !drw_clientside(drw, 1, renderthreads))
+		fputs("dwm: client-side rendering not supported, using the X server\n", stderr);
 	if (!drw_fontset_create(drw, fonts, LENGTH(fonts)))
 		die("no fonts could be loaded.");
 	lrpad = drw->fonts->h;
@@ -2365,7 +3659,9 @@ seturgent(Client *c, int urg)
 {
 	XWMHints *wmh;
 
+	tagcount(c, -1);
 	c->isurgent = urg;
+	tagcount(c, 1);
 	if (!(wmh = XGetWMHints(dpy, c->win)))
 		return;
 	wmh->flags = urg ? (wmh->flags | XUrgencyHint) : (wmh->flags & ~XUrgencyHint);
@@ -2396,22 +3692,38 @@ showhide(Client *c)
 }
 
 void
-sigchld(int unused)
+sigchld(void)
 {
-	if (signal(SIGCHLD, sigchld) == SIG_ERR)
-		die("can't install SIGCHLD handler:");
 	while (0 < waitpid(-1, NULL, WNOHANG));
 }
 
 void
-sighup(int unused)
+sighup(void)
 {
 	Arg a = {.i = 1};
 	quit(&a);
 }
 
+/*
+ * Dispatch signals pending on the signalfd. Runs synchronously from the main
+ * loop, thus the handlers may safely touch any state.
+ */
+void
+signals(void)
+{
+	struct signalfd_siginfo si;
+
+	while (read(sigsrc.fd, &si, sizeof si) == sizeof si) {
+		switch (si.ssi_signo) {
+		case SIGCHLD: sigchld(); break;
+		case SIGHUP:  sighup();  break;
+		case SIGTERM: sigterm(); break;
+		}
+	}
+}
+
 void
-sigterm(int unused)
+sigterm(void)
 {
 	Arg a = {.i = 0};
 	quit(&a);
@@ -2420,9 +3732,15 @@ sigterm(int unused)
 void
 spawn(const Arg *arg)
 {
+	sigset_t sm;
+
 	if (fork() == 0) {
 		if (dpy)
 			close(ConnectionNumber(dpy));
+		/* The signal mask is inherited across execvp(). Don't pass on the
+		 * signals blocked for the signalfd. */
+		sigemptyset(&sm);
+		sigprocmask(SIG_SETMASK, &sm, NULL);
 		setsid();
 		execvp(((char **)arg->v)[0], (char **)arg->v);
 		fprintf(stderr, "dwm: execvp %s", ((char **)arg->v)[0]);
@@ -2462,6 +3780,7 @@ swal(Client *swer, Client *swee, int manage)
 	for (pc = &swer->mon->clients; *pc && *pc != swer; pc = &(*pc)->next);
 	*pc = swee;
 	swee->next = swer->next;
+	tagcount(swer, -1);
 	detachstack(swee);
 	for (pc = &swer->mon->stack; *pc && *pc != swer; pc = &(*pc)->snext);
 	*pc = swee;
@@ -2473,9 +3792,11 @@ swal(Client *swer, Client *swee, int manage)
 		selmon = swer->mon;
 	}
 	swee->tags = swer->tags;
+	tagcount(swee, 1);
 	swee->isfloating = swer->isfloating;
 	for (c = swee; c->swallowedby; c = c->swallowedby);
 	c->swallowedby = swer;
+	winchain(swee);
 
 	/* Configure geometry params obtained from patches (e.g. cfacts) here. */
 	swee->cfact = swer->cfact;
@@ -2486,7 +3807,7 @@ swal(Client *swer, Client *swee, int manage)
 		setclientstate(swee, NormalState);
 
 	if (swee->isfloating || !swee->mon->lt[swee->mon->sellt]->arrange)
-		XRaiseWindow(dpy, swee->win);
+		raiseclient(swee);
 	resize(swee, swer->x, swer->y, swer->w, swer->h, 0);
 
 	focus(NULL);
@@ -2516,16 +3837,18 @@ swalstop(Client *swee, Client *root)
 	swer->tags = root->tags;
 	swer->next = root->next;
 	root->next = swer;
+	tagcount(swer, 1);
 	swer->snext = root->snext;
 	root->snext = swer;
 	swer->isfloating = swee->isfloating;
+	winchain(swer);
 
 	/* Configure geometry params obtained from patches (e.g. cfacts) here. */
 	swer->cfact = 1.0;
 
 	/* If swer is not in tiling mode reuse swee's geometry. */
 	if (swer->isfloating || !root->mon->lt[root->mon->sellt]->arrange) {
-		XRaiseWindow(dpy, swer->win);
+		raiseclient(swer);
 		resize(swer, swee->x, swee->y, swee->w, swee->h, 0);
 	}
 
@@ -2554,12 +3877,34 @@ void
 tag(const Arg *arg)
 {
 	if (selmon->sel && arg->ui & TAGMASK) {
+		tagcount(selmon->sel, -1);
 		selmon->sel->tags = arg->ui & TAGMASK;
+		tagcount(selmon->sel, 1);
 		focus(NULL);
 		arrange(selmon);
 	}
 }
 
+/*
+ * Add the client to the per-tag counters of its monitor if 'n' is 1, or remove
+ * it if 'n' is -1. Clients are counted while in their monitor's client list,
+ * so changes to the tags or urgency of such a client must be bracketed by
+ * removing and re-adding it.
+ */
+void
+tagcount(Client *c, int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < LENGTH(tags); i++) {
+		if (!(c->tags & 1 << i))
+			continue;
+		c->mon->ntagged[i] += n;
+		if (c->isurgent)
+			c->mon->nurgent[i] += n;
+	}
+}
+
 /*
  * Moves selected client to next/prev monitor
  */
@@ -2576,41 +3921,60 @@ tagmon(const Arg *arg)
 }
 
 void
-tile(Monitor *m)
+tile(Monitor *m, Geom *g)
 {
-	unsigned int i, n, h, mw, my, ty;
-	float mfacts = 0, sfacts = 0;
+	unsigned int n, nm;
+	int mw;
 	Client *c;
 
-	for (n = 0, c = nexttiled(m->clients); c; c = nexttiled(c->next), n++) {
-		if (n < m->nmaster)
-			mfacts += c->cfact;
-		else
-			sfacts += c->cfact;
-	}
+	for (n = 0, c = nexttiled(m->clients); c; c = nexttiled(c->next), n++);
 	if (n == 0)
 		return;
+	nm = MIN(n, m->nmaster);
 
 	if (n > m->nmaster)
 		mw = m->nmaster ? m->ww * m->mfact : 0;
 	else
 		mw = m->ww - m->gappx;
 
-	for (i = 0, my = ty = m->gappx, c = nexttiled(m->clients); c; c = nexttiled(c->next), i++) {
-		if (i < m->nmaster) {
-			h = (m->wh - my) * (c->cfact / mfacts) - m->gappx;
-			resize(c, m->wx + m->gappx, m->wy + my, mw - (2*c->bw) - m->gappx, h - (2*c->bw), 0);
-			my += HEIGHT(c) + m->gappx;
-
-			mfacts -= c->cfact;
-		} else {
-			h = (m->wh - ty) * (c->cfact / sfacts) - m->gappx;
-			resize(c, m->wx + mw + m->gappx, m->wy + ty, m->ww - mw - (2*c->bw) - 2*m->gappx, h - (2*c->bw), 0);
-			ty += HEIGHT(c) + m->gappx;
+	c = tilecolumn(m, g, nexttiled(m->clients), nm, m->gappx, mw - m->gappx);
+	tilecolumn(m, g + nm, c, n - nm, mw + m->gappx, m->ww - mw - 2*m->gappx);
+}
 
-			sfacts -= c->cfact;
+/*
+ * Stack 'n' tiled clients starting at 'c' in a column at offset 'x' of width
+ * 'w' (borders included) spanning the window area of 'm', and return the next
+ * tiled client. Heights are proportional to the clients' cfacts in fixed
+ * point: the i-th client ends at the fraction of the space given by the sum
+ * of the first i weights, so leftover pixels are spread the same way on every
+ * arrange. Space that size hints leave unused goes to the clients below.
+ */
+Client *
+tilecolumn(Monitor *m, Geom *g, Client *c, unsigned int n, int x, int w)
+{
+	unsigned long sum = 0, done = 0, top, bot;
+	unsigned int i;
+	long space;
+	int y = m->gappx, h;
+	Client *t;
+
+	for (i = 0, t = c; i < n; i++, t = nexttiled(t->next))
+		sum += CFACTFIX(t);
+	space = MAX(m->wh - (long)m->gappx * (n + 1), 0);
+	for (i = 0; i < n; i++, c = nexttiled(c->next)) {
+		top = space * done / sum;
+		done += CFACTFIX(c);
+		bot = space * done / sum;
+		h = bot - top;
+		setgeom(&g[i], c, m->wx + x, m->wy + y, w - 2*c->bw, h - 2*c->bw);
+		y += g[i].h + 2*c->bw + m->gappx;
+		if (g[i].h + 2*c->bw != h) {
+			space = MAX(m->wh - y - (long)m->gappx * (n - i - 1), 0);
+			sum -= done;
+			done = 0;
 		}
 	}
+	return c;
 }
 
 void
@@ -2658,7 +4022,9 @@ toggletag(const Arg *arg)
 		return;
 	newtags = selmon->sel->tags ^ (arg->ui & TAGMASK);
 	if (newtags) {
+		tagcount(selmon->sel, -1);
 		selmon->sel->tags = newtags;
+		tagcount(selmon->sel, 1);
 		focus(NULL);
 		arrange(selmon);
 	}
@@ -2711,14 +4077,15 @@ unmanage(Client *c, int destroyed)
 		XConfigureWindow(dpy, c->win, CWBorderWidth, &wc); /* restore border */
 		XUngrabButton(dpy, AnyButton, AnyModifier, c->win);
 		setclientstate(c, WithdrawnState);
-		XSync(dpy, False);
+		xsync();
 		XSetErrorHandler(xerror);
 		XUngrabServer(dpy);
 	}
 
+	windel(c->win);
 	free(c);
 	focus(NULL);
-	updateclientlist();
+	m->dirty |= DirtyClientList;
 	arrange(m);
 
 }
@@ -2767,7 +4134,24 @@ updatebars(void)
 		.event_mask = ButtonPressMask|ExposureMask
 	};
 	XClassHint ch = {"dwm", "dwm"};
+#ifdef STATS
+	unsigned long mem = 0;
+#endif
+
 	for (m = mons; m; m = m->next) {
+		/* (Re)allocate the back buffer if the bar's width has changed. */
+		if (m->barbufw != m->ww) {
+			if (m->barbuf) {
+				drw_forget(drw, m->barbuf);
+				XFreePixmap(dpy, m->barbuf);
+			}
+			m->barbuf = XCreatePixmap(dpy, root, m->ww, bh, depth);
+			m->barbufw = m->ww;
+			m->barvalid = 0;
+		}
+#ifdef STATS
+		mem += (unsigned long)m->barbufw * bh * (depth > 16 ? 4 : depth > 8 ? 2 : 1);
+#endif
 		if (m->barwin)
 			continue;
 		m->barwin = XCreateWindow(dpy, root, m->wx, m->by, m->ww, bh, 0, depth,
@@ -2777,6 +4161,9 @@ updatebars(void)
 		XMapRaised(dpy, m->barwin);
 		XSetClassHint(dpy, m->barwin, &ch);
 	}
+#ifdef STATS
+	fprintf(stderr, "dwm: bar buffers: %lu bytes\n", mem);
+#endif
 }
 
 void
@@ -2923,42 +4310,50 @@ updatesizehints(Client *c)
 	/* size is uninitialized, ensure that size.flags aren't used */
 	if (!XGetWMNormalHints(dpy, c->win, &size, &msize))
 		size.flags = PSize;
+	setsizehints(c, &size);
+}
 
+/*
+ * Set a client's size hint parameters from WM_NORMAL_HINTS
+ */
+void
+setsizehints(Client *c, XSizeHints *size)
+{
 	/* XPM 3.2.8: base_width/base_height takes priority over
 	 * min_width/max_width. Only one of these pairs should be set. */
-	if (size.flags & PBaseSize) {
-		c->basew = size.base_width;
-		c->baseh = size.base_height;
-	} else if (size.flags & PMinSize) {
-		c->basew = size.min_width;
-		c->baseh = size.min_height;
+	if (size->flags & PBaseSize) {
+		c->basew = size->base_width;
+		c->baseh = size->base_height;
+	} else if (size->flags & PMinSize) {
+		c->basew = size->min_width;
+		c->baseh = size->min_height;
 	} else
 		c->basew = c->baseh = 0;
 
-	if (size.flags & PResizeInc) {
-		c->incw = size.width_inc;
-		c->inch = size.height_inc;
+	if (size->flags & PResizeInc) {
+		c->incw = size->width_inc;
+		c->inch = size->height_inc;
 	} else
 		c->incw = c->inch = 0;
 
-	if (size.flags & PMaxSize) {
-		c->maxw = size.max_width;
-		c->maxh = size.max_height;
+	if (size->flags & PMaxSize) {
+		c->maxw = size->max_width;
+		c->maxh = size->max_height;
 	} else
 		c->maxw = c->maxh = 0;
 
-	if (size.flags & PMinSize) {
-		c->minw = size.min_width;
-		c->minh = size.min_height;
-	} else if (size.flags & PBaseSize) {
-		c->minw = size.base_width;
-		c->minh = size.base_height;
+	if (size->flags & PMinSize) {
+		c->minw = size->min_width;
+		c->minh = size->min_height;
+	} else if (size->flags & PBaseSize) {
+		c->minw = size->base_width;
+		c->minh = size->base_height;
 	} else
 		c->minw = c->minh = 0;
 
-	if (size.flags & PAspect) {
-		c->mina = (float)size.min_aspect.y / size.min_aspect.x;
-		c->maxa = (float)size.max_aspect.x / size.max_aspect.y;
+	if (size->flags & PAspect) {
+		c->mina = (float)size->min_aspect.y / size->min_aspect.x;
+		c->maxa = (float)size->max_aspect.x / size->max_aspect.y;
 	} else
 		c->maxa = c->mina = 0.0;
 
@@ -2979,7 +4374,22 @@ updatetitle(Client *c)
 {
 	XClassHint ch = { NULL, NULL };
 
-	if (!XGetClassHint(dpy, c->win, &ch) || !ch.res_class) {
+	XGetClassHint(dpy, c->win, &ch);
+	settitle(c, ch.res_class);
+	if (ch.res_class)
+		XFree(ch.res_class);
+	if (ch.res_name)
+		XFree(ch.res_name);
+}
+
+/*
+ * Set a client's display name from its class name 'class', which is NULL for
+ * broken clients.
+ */
+void
+settitle(Client *c, const char *class)
+{
+	if (!class) {
 		strcpy(c->name, broken); /* mark broken clients */
 		return;
 	}
@@ -2989,20 +4399,23 @@ updatetitle(Client *c)
 	 * (as per X11 protocol). Hence there's no need to call updatetitle() each
 	 * time the window title propery changes. For the sake of compatibility,
 	 * however, we'll leave this implementation to resemble original dwm. */
-	strncpy(c->name, ch.res_class, sizeof(c->name) - 1);
-	if (ch.res_class)
-		XFree(ch.res_class);
-	if (ch.res_name)
-		XFree(ch.res_name);
+	strncpy(c->name, class, sizeof(c->name) - 1);
 }
 
 
 void
 updatewindowtype(Client *c)
 {
-	Atom state = getatomprop(c, netatom[NetWMState]);
-	Atom wtype = getatomprop(c, netatom[NetWMWindowType]);
+	setwindowtype(c, getatomprop(c, netatom[NetWMState]),
+		getatomprop(c, netatom[NetWMWindowType]));
+}
 
+/*
+ * Apply the first atoms of _NET_WM_STATE and _NET_WM_WINDOW_TYPE.
+ */
+void
+setwindowtype(Client *c, Atom state, Atom wtype)
+{
 	if (state == netatom[NetWMFullscreen])
 		fakefullscreen(c, 1);
 	if (wtype == netatom[NetWMWindowTypeDialog])
@@ -3015,26 +4428,37 @@ updatewmhints(Client *c)
 	XWMHints *wmh;
 
 	if ((wmh = XGetWMHints(dpy, c->win))) {
-		if (c == selmon->sel && wmh->flags & XUrgencyHint) {
-			/* If the active window fancies itself urgent, clear its urgency
-			 * flag immediately, as there's no better measure to satisfy an
-			 * urgent window than to give it focus. .. */
-			wmh->flags &= ~XUrgencyHint;
-			XSetWMHints(dpy, c->win, wmh);
-		} else {
-			/* .. otherwise simply set the urgency field. */
-			c->isurgent = (wmh->flags & XUrgencyHint) ? 1 : 0;
-		}
-
-		/* XPM 12.3.1.4.2: confuses me :( */
-		if (wmh->flags & InputHint)
-			c->neverfocus = !wmh->input;
-		else
-			c->neverfocus = 0;
+		tagcount(c, -1);
+		setwmhints(c, wmh);
+		tagcount(c, 1);
 		XFree(wmh);
 	}
 }
 
+/*
+ * Set a client's urgency and input focus fields from WM_HINTS
+ */
+void
+setwmhints(Client *c, XWMHints *wmh)
+{
+	if (c == selmon->sel && wmh->flags & XUrgencyHint) {
+		/* If the active window fancies itself urgent, clear its urgency
+		 * flag immediately, as there's no better measure to satisfy an
+		 * urgent window than to give it focus. .. */
+		wmh->flags &= ~XUrgencyHint;
+		XSetWMHints(dpy, c->win, wmh);
+	} else {
+		/* .. otherwise simply set the urgency field. */
+		c->isurgent = (wmh->flags & XUrgencyHint) ? 1 : 0;
+	}
+
+	/* XPM 12.3.1.4.2: confuses me :( */
+	if (wmh->flags & InputHint)
+		c->neverfocus = !wmh->input;
+	else
+		c->neverfocus = 0;
+}
+
 /* Select which tags to view. UI-function. */
 void
 view(const Arg *arg)
@@ -3048,19 +4472,118 @@ view(const Arg *arg)
 	arrange(selmon);
 }
 
-Client *
-wintoclient(Window w)
+/*
+ * Enter client 'c' into the window table or update its entry. 'root' is the
+ * head of the swallow chain if 'c' is a swallower and NULL otherwise.
+ */
+void
+winadd(Client *c, Client *root)
+{
+	WinEntry *e, *old = wintab;
+	size_t i, cap = old ? (size_t)1 << wintabbits : 0;
+
+	if ((e = winlookup(c->win))) {
+		e->c = c;
+		e->root = root;
+		return;
+	}
+	/* Keep the load factor below 1/2. */
+	if (2 * (wintabn + 1) > cap) {
+		wintabbits = old ? wintabbits + 1 : 6;
+		wintab = ecalloc((size_t)1 << wintabbits, sizeof(WinEntry));
+		wintabn = 0;
+		for (i = 0; i < cap; i++)
+			if (old[i].c)
+				winadd(old[i].c, old[i].root);
+		free(old);
+	}
+	for (i = winhash(c->win); wintab[i].c; i = (i + 1) & (((size_t)1 << wintabbits) - 1));
+	wintab[i].win = c->win;
+	wintab[i].c = c;
+	wintab[i].root = root;
+	wintabn++;
+}
+
+/*
+ * Update the window table's entries of the swallow chain headed by 'head'
+ * after the chain has been changed.
+ */
+void
+winchain(Client *head)
 {
 	Client *c;
-	Monitor *m;
 
-	for (m = mons; m; m = m->next)
-		for (c = m->clients; c; c = c->next)
-			if (c->win == w)
-				return c;
+	if (!head)
+		return;
+	winadd(head, NULL);
+	for (c = head->swallowedby; c; c = c->swallowedby)
+		winadd(c, head);
+}
+
+/*
+ * Remove window 'w' from the window table. Entries following it in its probe
+ * sequence are shifted back to fill the gap, such that no tombstones are
+ * needed.
+ */
+void
+windel(Window w)
+{
+	WinEntry *e;
+	size_t i, j, k, mask;
+
+	if (!(e = winlookup(w)))
+		return;
+	mask = ((size_t)1 << wintabbits) - 1;
+	for (i = j = e - wintab;;) {
+		j = (j + 1) & mask;
+		if (!wintab[j].c)
+			break;
+		k = winhash(wintab[j].win);
+		/* The entry at 'j' may fill slot 'i' unless its home slot 'k' lies
+		 * cyclically in (i, j]. */
+		if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+			wintab[i] = wintab[j];
+			i = j;
+		}
+	}
+	wintab[i].c = NULL;
+	wintabn--;
+}
+
+/* Fibonacci hashing */
+size_t
+winhash(Window w)
+{
+	return (size_t)(((unsigned long long)w * 0x9e3779b97f4a7c15ULL) >> (64 - wintabbits));
+}
+
+/*
+ * Return the window table's entry of window 'w' or NULL if 'w' is not
+ * managed by any client. The table holds every managed window including
+ * swallowers and is maintained by manage(), unmanage(), swal() and
+ * swalstop() et al.
+ */
+WinEntry *
+winlookup(Window w)
+{
+	size_t i;
+
+	if (!wintabn)
+		return NULL;
+	for (i = winhash(w); wintab[i].c; i = (i + 1) & (((size_t)1 << wintabbits) - 1))
+		if (wintab[i].win == w)
+			return &wintab[i];
 	return NULL;
 }
 
+Client *
+wintoclient(Window w)
+{
+	WinEntry *e;
+
+	return (e = winlookup(w)) && !e->root ? e->c : NULL;
+}
+
 /*
  * Writes client managing window 'w' into 'pc' and returns type of client. If
  * no client is found NULL is written to 'pc' and zero is returned. If a client
@@ -3070,32 +4593,19 @@ wintoclient(Window w)
 int
 wintoclient2(Window w, Client **pc, Client **proot)
 {
-	Monitor *m;
-	Client *c, *d;
+	WinEntry *e;
 
-	for (m = mons; m; m = m->next) {
-		for (c = m->clients; c; c = c->next) {
-			if (c->win == w) {
-				*pc = c;
-				if (c->swallowedby)
-					return ClientSwallowee;
-				else
-					return ClientRegular;
-			}
-			else {
-				for (d = c->swallowedby; d; d = d->swallowedby) {
-					if (d->win == w) {
-						if (proot)
-							*proot = c;
-						*pc = d;
-						return ClientSwallower;
-					}
-				}
-			}
-		}
+	if (!(e = winlookup(w))) {
+		*pc = NULL;
+		return 0;
 	}
-	*pc = NULL;
-	return 0;
+	*pc = e->c;
+	if (e->root) {
+		if (proot)
+			*proot = e->root;
+		return ClientSwallower;
+	}
+	return e->c->swallowedby ? ClientSwallowee : ClientRegular;
 }
 
 /*
@@ -3106,26 +4616,76 @@ wintoclient2(Window w, Client **pc, Client **proot)
 Swallow *
 swalmatch(Window w)
 {
-	XClassHint ch = { NULL, NULL };
+	xcb_get_property_cookie_t ck[2];
+	xcb_get_property_reply_t *r[2];
 	Swallow *s = NULL;
-	char title[sizeof(s->title)];
-
-	XGetClassHint(dpy, w, &ch);
-	if (!gettextprop(w, netatom[NetWMName], title, sizeof(title)))
+	char class[256], inst[256], title[sizeof(s->title)], raw[sizeof title + 1];
+	const char *v;
+	XTextProperty name;
+	unsigned long bits;
+	size_t i, j, words;
+	int len, n, hasinst = 0, hasclass = 0;
+
+	if (!swallows)
+		return NULL;
+
+	/* Fetch class and title in a single round trip. */
+	ck[0] = xcb_get_property(xcon, 0, w, XA_WM_CLASS, XA_STRING, 0, sizeof class / 2);
+	ck[1] = xcb_get_property(xcon, 0, w, netatom[NetWMName], XCB_GET_PROPERTY_TYPE_ANY,
+		0, sizeof title / 4);
+	r[0] = xcb_get_property_reply(xcon, ck[0], NULL);
+	r[1] = xcb_get_property_reply(xcon, ck[1], NULL);
+	class[0] = inst[0] = title[0] = '\0';
+	if (r[0] && r[0]->type == XA_STRING && r[0]->format == 8
+	&& (len = xcb_get_property_value_length(r[0])) > 0) {
+		/* The value consists of two consecutive null-terminated strings. */
+		v = xcb_get_property_value(r[0]);
+		n = strnlen(v, len);
+		snprintf(inst, sizeof inst, "%.*s", n, v);
+		hasinst = 1;
+		if (n + 1 < len) {
+			snprintf(class, sizeof class, "%.*s", (int)strnlen(v + n + 1, len - n - 1), v + n + 1);
+			hasclass = 1;
+		}
+	}
+	if (r[1] && r[1]->format == 8 && (len = xcb_get_property_value_length(r[1])) > 0) {
+		/* Decode the title as gettextprop() would. */
+		len = MIN(len, (int)sizeof title);
+		memcpy(raw, xcb_get_property_value(r[1]), len);
+		raw[len] = '\0';
+		name.value = (unsigned char *)raw;
+		name.encoding = r[1]->type;
+		name.format = 8;
+		name.nitems = len;
+		textpropstr(&name, title, sizeof title);
+	} else {
 		gettextprop(w, XA_WM_NAME, title, sizeof(title));
-
-	for (s = swallows; s; s = s->next) {
-		if ((!ch.res_class || strstr(ch.res_class, s->class))
-			&& (!ch.res_name || strstr(ch.res_name, s->inst))
-			&& (title[0] == '\0' || strstr(title, s->title)))
-			break;
 	}
-
-	if (ch.res_class)
-		XFree(ch.res_class);
-	if (ch.res_name)
-		XFree(ch.res_name);
-	return s;
+	free(r[0]);
+	free(r[1]);
+
+	/* A window without class or instance matches any filter thereof.
+	 * Among the candidates the first one in the pool whose title filter
+	 * matches wins. */
+	if (swaldirty)
+		swalindex();
+	words = nswalvec / LONGBITS + 1;
+	memset(swalbits[0], hasclass ? 0 : 0xff, words * sizeof(unsigned long));
+	memset(swalbits[1], hasinst ? 0 : 0xff, words * sizeof(unsigned long));
+	if (hasclass)
+		matcher_match(swalmatcher[0], class, matchbit, swalbits[0]);
+	if (hasinst)
+		matcher_match(swalmatcher[1], inst, matchbit, swalbits[1]);
+	for (i = 0; i < words; i++) {
+		for (bits = swalbits[0][i] & swalbits[1][i]; bits; bits &= bits - 1) {
+			if ((j = i * LONGBITS + __builtin_ctzl(bits)) >= nswalvec)
+				break;
+			s = swalvec[j];
+			if (title[0] == '\0' || strstr(title, s->title))
+				return s;
+		}
+	}
+	return NULL;
 }
 
 Monitor *
@@ -3145,6 +4705,45 @@ wintomon(Window w)
 	return selmon;
 }
 
+/*
+ * Dispatch all events queued or readable on the X connection. Events are
+ * drained into batches which are coalesced before being dispatched.
+ */
+void
+xevents(void)
+{
+	int i, n, type;
+
+	while (running && XPending(dpy)) {
+		/* Key and button presses end a batch, as their handlers may run
+		 * nested event loops (e.g. movemouse()) which expect subsequent
+		 * events to remain in Xlib's queue. */
+		n = 0;
+		do {
+			XNextEvent(dpy, &batch[n]);
+			type = batch[n++].type;
+		} while (type != KeyPress && type != ButtonPress
+			&& n < LENGTH(batch) && XEventsQueued(dpy, QueuedAlready));
+		coalesce(batch, n);
+		for (i = 0; i < n && running; i++)
+			if (handler[batch[i].type])
+				handler[batch[i].type](&batch[i]); /* call handler */
+		commit();
+	}
+}
+
+/*
+ * Wait until all requests have been processed by the server. Calls are
+ * counted for STATS. Other round trips, such as those of XGetWMHints() or
+ * XGetWMNormalHints(), are not.
+ */
+void
+xsync(void)
+{
+	nsyncs++;
+	XSync(dpy, False);
+}
+
 /* There's no way to check accesses to destroyed windows, thus those cases are
  * ignored (especially on UnmapNotify's). Other types of errors call Xlibs
  * default error handler, which may call exit. */
@@ -3252,9 +4851,13 @@ main(int argc, char *argv[])
 	if (pledge("stdio rpath proc exec", NULL) == -1)
 		die("pledge");
 #endif /* __OpenBSD__ */
+	loadstate(); /* adopt the windows of a restarted instance */
 	scan(); /* load existing windows */
 	run();
-	if(restart) execvp(argv[0], argv);
+	if (restart) {
+		savestate();
+		execvp(argv[0], argv);
+	}
 	cleanup();
 	XCloseDisplay(dpy);
 	return EXIT_SUCCESS;
@@ -0,0 +1,136 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdlib.h>
+#include <string.h>
+
+#include "match.h"
+#include "util.h"
+
+/* Trie node. Children are kept as a singly linked list of siblings, as the
+ * fan-out of a trie built from a few hundred patterns is small. Node 0 is
+ * the root; as the root is never a child, 0 doubles as 'none'. */
+typedef struct {
+	unsigned char sym; /* label of the edge leading to the node */
+	unsigned int child, sibling;
+	unsigned int fail; /* node of the longest proper suffix */
+	unsigned int dict; /* nearest node on the fail chain with outputs */
+	unsigned int out; /* outputs, index into Matcher.outs + 1 */
+} Node;
+
+typedef struct {
+	unsigned int id;
+	unsigned int next; /* index into Matcher.outs + 1 */
+} Out;
+
+struct Matcher {
+	Node *nodes;
+	size_t nnodes, capnodes;
+	Out *outs;
+	size_t nouts, capouts;
+};
+
+static unsigned int
+child(const Matcher *m, unsigned int n, unsigned char c)
+{
+	unsigned int i;
+
+	for (i = m->nodes[n].child; i && m->nodes[i].sym != c; i = m->nodes[i].sibling);
+	return i;
+}
+
+Matcher *
+matcher_create(void)
+{
+	Matcher *m;
+
+	m = ecalloc(1, sizeof(Matcher));
+	m->capnodes = 64;
+	m->nodes = ecalloc(m->capnodes, sizeof(Node));
+	m->nnodes = 1;
+	return m;
+}
+
+void
+matcher_add(Matcher *m, const char *pattern, unsigned int id)
+{
+	const unsigned char *p;
+	unsigned int n, i;
+
+	for (n = 0, p = (const unsigned char *)pattern; *p; p++, n = i) {
+		if ((i = child(m, n, *p)))
+			continue;
+		if (m->nnodes == m->capnodes) {
+			m->capnodes *= 2;
+			if (!(m->nodes = realloc(m->nodes, m->capnodes * sizeof(Node))))
+				die("realloc:");
+		}
+		i = m->nnodes++;
+		memset(&m->nodes[i], 0, sizeof(Node));
+		m->nodes[i].sym = *p;
+		m->nodes[i].sibling = m->nodes[n].child;
+		m->nodes[n].child = i;
+	}
+	if (m->nouts == m->capouts) {
+		m->capouts = m->capouts ? 2 * m->capouts : 16;
+		if (!(m->outs = realloc(m->outs, m->capouts * sizeof(Out))))
+			die("realloc:");
+	}
+	m->outs[m->nouts].id = id;
+	m->outs[m->nouts].next = m->nodes[n].out;
+	m->nodes[n].out = ++m->nouts;
+}
+
+/* Compute the fail and dictionary links breadth first. Must be called after
+ * the last matcher_add() and before the first matcher_match(). */
+void
+matcher_compile(Matcher *m)
+{
+	unsigned int *queue, head, tail, n, i, f;
+
+	queue = ecalloc(m->nnodes, sizeof(unsigned int));
+	head = tail = 0;
+	for (i = m->nodes[0].child; i; i = m->nodes[i].sibling) {
+		m->nodes[i].fail = m->nodes[i].dict = 0;
+		queue[tail++] = i;
+	}
+	while (head < tail) {
+		n = queue[head++];
+		for (i = m->nodes[n].child; i; i = m->nodes[i].sibling) {
+			for (f = m->nodes[n].fail; f && !child(m, f, m->nodes[i].sym); f = m->nodes[f].fail);
+			f = child(m, f, m->nodes[i].sym);
+			m->nodes[i].fail = f;
+			m->nodes[i].dict = m->nodes[f].out ? f : m->nodes[f].dict;
+			queue[tail++] = i;
+		}
+	}
+	free(queue);
+}
+
+/* Call 'func' for every occurrence of every pattern in 'text'. The empty
+ * pattern matches once. */
+void
+matcher_match(const Matcher *m, const char *text, void (*func)(unsigned int id, void *arg), void *arg)
+{
+	const unsigned char *p;
+	unsigned int n, i = 0, o;
+
+	for (o = m->nodes[0].out; o; o = m->outs[o - 1].next)
+		func(m->outs[o - 1].id, arg);
+	for (n = 0, p = (const unsigned char *)text; *p; p++) {
+		while (n && !(i = child(m, n, *p)))
+			n = m->nodes[n].fail;
+		n = n ? i : child(m, 0, *p);
+		for (i = m->nodes[n].out ? n : m->nodes[n].dict; i; i = m->nodes[i].dict)
+			for (o = m->nodes[i].out; o; o = m->outs[o - 1].next)
+				func(m->outs[o - 1].id, arg);
+	}
+}
+
+void
+matcher_free(Matcher *m)
+{
+	if (!m)
+		return;
+	free(m->nodes);
+	free(m->outs);
+	free(m);
+}
@@ -0,0 +1,12 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Multi-pattern substring matcher (Aho-Corasick). Patterns are added with an
+ * arbitrary id and compiled once; matcher_match() then reports the ids of all
+ * patterns occurring in a text in a single pass over the text. */
+typedef struct Matcher Matcher;
+
+Matcher *matcher_create(void);
+void matcher_add(Matcher *m, const char *pattern, unsigned int id);
+void matcher_compile(Matcher *m);
+void matcher_match(const Matcher *m, const char *text, void (*func)(unsigned int id, void *arg), void *arg);
+void matcher_free(Matcher *m);